@@ -0,0 +1,483 @@
+#include "fat.h"
+#include "pool.h"
+#include "cache.h"
+#include "device.h"
+#include "index.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+// Batch driver (fat --batch <op> [options] <image>...). Runs one operation
+// over many images in a single process, on one worker pool shared by all
+// of them, and writes JSON lines tagged with the image they came from.
+//
+//   list      one line per file: path, size, first cluster
+//   hash      one line per file: CRC32C and SHA-256 (xxHash64 with -x)
+//   check     one line per image: FAT copies, chains, sizes, lost clusters
+//   extract   copies every file to <dir>/<image name>/<path> (-o <dir>);
+//             images that share a file name get a .<n> suffix
+//
+// An image is opened, walked and then worked on by at most -j tasks at a
+// time, so one large image can't starve the others of the pool or of disk
+// bandwidth; at most MAX_OPEN_IMAGES are open at once. Each image's lines
+// are written together, in walk order, once the image is done. A path of
+// "-" reads further image paths from stdin, one per line.
+
+#define MAX_OPEN_IMAGES 64
+#define BATCH_CACHE_SECTORS 256
+#define DEFAULT_PER_IMAGE 4
+#define MAX_CHECK_ERRORS 20
+
+typedef enum { OP_LIST, OP_HASH, OP_CHECK, OP_EXTRACT } Operation;
+
+typedef struct batch_t Batch;
+
+typedef struct {
+  Batch *batch;
+  char *path;
+  char *out_name;             // directory under out_dir for extract
+  Cursor cursor;
+  BPB bpb;
+  FileList list;
+
+  // Output, one JSON line per entry, emitted when the image is done
+  char **lines;
+  int line_count;
+
+  pthread_mutex_t lock;
+  int next;                   // next file to hand to a worker
+  int workers;                // workers still running
+} Image;
+
+struct batch_t {
+  Pool *pool;
+  Operation op;
+  bool use_xxh;
+  int per_image;
+  const char *out_dir;
+
+  Image *images;
+  int count;
+  pthread_mutex_t lock;       // guards next_image and stdout
+  int next_image;
+  int failed;
+};
+
+static void start_next_image(Batch *batch);
+
+/********** Output ***********/
+
+// Formats a JSON line into a fresh string
+static char *format_line(Image *image, const char *path, const char *fmt, ...) {
+  char *buf;
+  size_t size;
+  FILE *out = open_memstream(&buf, &size);
+  fprintf(out, "{\"image\": ");
+  print_json_string(out, image->path);
+  if (path) {
+    fprintf(out, ", \"path\": ");
+    print_json_string(out, path);
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+  fprintf(out, "}\n");
+  fclose(out);
+  return buf;
+}
+
+static char *json_string(const char *s) {
+  char *buf;
+  size_t size;
+  FILE *out = open_memstream(&buf, &size);
+  print_json_string(out, s);
+  fclose(out);
+  return buf;
+}
+
+static void add_line(Image *image, char *line) {
+  image->lines = realloc(image->lines, sizeof(char *) * (image->line_count + 1));
+  image->lines[image->line_count++] = line;
+}
+
+/********** Images ***********/
+
+static bool open_image(Image *image) {
+  Cursor *cursor = &image->cursor;
+  Device *device = image_open(image->path);
+  if (!device) return false;
+  if (!read_boot_sector(&image->bpb, device)) {
+    device->close(device);
+    return false;
+  }
+
+  // Read-only use: interrupted journals and moves are left for the shell
+  cursor->device = device;
+  cursor->image_path = image->path;
+  cursor->bpb = &image->bpb;
+  cursor->cache = cache_create(device, &image->bpb, BATCH_CACHE_SECTORS, NULL);
+  load_index(cursor);
+  load_fat(cursor);
+  return true;
+}
+
+static void close_batch_image(Image *image) {
+  Cursor *cursor = &image->cursor;
+  int i;
+  if (cursor->device) {
+    drop_index(cursor);
+    if (cursor->index) free(cursor->index->path);
+    free(cursor->index);
+    cache_destroy(cursor->cache);
+    cursor->device->close(cursor->device);
+    free(cursor->fat);
+  }
+  free_file_list(&image->list);
+  for (i = 0; i < image->line_count; i++) free(image->lines[i]);
+  free(image->lines);
+  pthread_mutex_destroy(&image->lock);
+}
+
+// Writes the image's lines and makes room for the next image
+static void finish_image(Image *image) {
+  Batch *batch = image->batch;
+  int i;
+  pthread_mutex_lock(&batch->lock);
+  for (i = 0; i < image->line_count; i++) fputs(image->lines[i], stdout);
+  fflush(stdout);
+  pthread_mutex_unlock(&batch->lock);
+  close_batch_image(image);
+  start_next_image(batch);
+}
+
+/********** Per-file work ***********/
+
+static char *hash_line(Image *image, FileRef *file) {
+  uint32_t crc;
+  char digest[HASH_HEX_LENGTH];
+  if (!hash_file(&image->cursor, &file->entry, image->batch->use_xxh, &crc, digest)) {
+    __sync_fetch_and_add(&image->batch->failed, 1);
+    return format_line(image, file->path, ", \"error\": \"unreadable chain\"");
+  }
+  return format_line(image, file->path, ", \"size\": %u, \"crc32c\": \"%08x\", \"%s\": \"%s\"",
+      file->entry.size, crc, image->batch->use_xxh ? "xxh64" : "sha256", digest);
+}
+
+static bool write_chunk(void *ctx, const char *buf, uint32_t length) {
+  return fwrite(buf, 1, length, ctx) == length;
+}
+
+static char *extract_line(Image *image, FileRef *file) {
+  char *dir = host_path(image->batch->out_dir, image->out_name);
+  char *target = host_path(dir, file->path);
+  free(dir);
+
+  make_parents(target);
+  FILE *out = fopen(target, "wb");
+  bool ok = out && stream_file(&image->cursor, &file->entry, write_chunk, out);
+  if (out && fclose(out) != 0) ok = false;
+
+  char *line;
+  if (ok) {
+    char *output = json_string(target);
+    line = format_line(image, file->path, ", \"size\": %u, \"output\": %s", file->entry.size, output);
+    free(output);
+  } else {
+    __sync_fetch_and_add(&image->batch->failed, 1);
+    line = format_line(image, file->path, ", \"error\": \"%s\"", out ? "unreadable chain" : strerror(errno));
+  }
+  free(target);
+  return line;
+}
+
+// Pulls files off the image until there are none left. The last worker
+// out finishes the image.
+static void file_worker(void *arg) {
+  Image *image = arg;
+  for (;;) {
+    pthread_mutex_lock(&image->lock);
+    int i = image->next < image->list.count ? image->next++ : -1;
+    pthread_mutex_unlock(&image->lock);
+    if (i < 0) break;
+
+    FileRef *file = &image->list.files[i];
+    image->lines[i] = image->batch->op == OP_HASH ? hash_line(image, file) : extract_line(image, file);
+  }
+
+  pthread_mutex_lock(&image->lock);
+  bool last = --image->workers == 0;
+  pthread_mutex_unlock(&image->lock);
+  if (last) finish_image(image);
+}
+
+/********** Check ***********/
+
+typedef struct {
+  Image *image;
+  uint16_t *fat;
+  uint32_t last;
+  uint32_t csize;
+  uint8_t *owned;             // clusters reached from the tree
+
+  uint32_t files;
+  uint32_t directories;
+  uint32_t cross_linked;
+  uint32_t bad_chains;
+  uint32_t size_mismatches;
+  int error_count;
+  FILE *errors;               // JSON array body
+} Check;
+
+static void check_error(Check *check, const char *path, const char *problem) {
+  if (check->error_count++ >= MAX_CHECK_ERRORS) return;
+  fprintf(check->errors, "%s{\"path\": ", check->error_count > 1 ? ", " : "");
+  print_json_string(check->errors, path);
+  fprintf(check->errors, ", \"problem\": \"%s\"}", problem);
+}
+
+// Follows a chain, claiming its clusters; returns its length
+static uint32_t claim_chain(Check *check, uint16_t start, const char *path) {
+  uint32_t length = 0;
+  uint16_t c = start;
+  while (c >= 2 && c < 0xFFF8) {
+    if (c >= check->last || check->fat[c] == 0 || check->fat[c] == 0xFFF7 || check->fat[c] == 1) {
+      check->bad_chains++;
+      check_error(check, path, "chain reaches a free, bad or invalid cluster");
+      break;
+    }
+    if (check->owned[c]) {
+      check->cross_linked++;
+      check_error(check, path, "cross-linked cluster");
+      break;
+    }
+    check->owned[c] = 1;
+    length++;
+    c = check->fat[c];
+  }
+  return length;
+}
+
+static void check_dir(Check *check, uint16_t cluster, const char *prefix, int depth) {
+  uint32_t length, i;
+  char *data = read_dir_data(&check->image->cursor, cluster, &length);
+  for (i = 0; i + 32 <= length; i += 32) {
+    Fat16Entry *entry = (Fat16Entry *)(data + i);
+    if (entry->name[0] == 0) break;
+    if (entry->name[0] == UNUSED_FLAG || entry->name[0] == '.' ||
+        (entry->attributes & DIR_ATTR_LFN) == DIR_ATTR_LFN || entry->attributes & DIR_ATTR_VOLUMEID)
+      continue;
+
+    char name[13];
+    entry_file_name(entry, name);
+    char *path = join_path(prefix, name);
+    if (entry->attributes & DIR_ATTR_DIRECTORY) {
+      check->directories++;
+      // A directory already claimed is a loop or a cross-link; don't descend twice
+      bool fresh = entry->starting_cluster >= 2 && entry->starting_cluster < check->last &&
+          !check->owned[entry->starting_cluster];
+      claim_chain(check, entry->starting_cluster, path);
+      if (fresh && depth < MAX_WALK_DEPTH) check_dir(check, entry->starting_cluster, path, depth + 1);
+    } else {
+      check->files++;
+      uint32_t want = (entry->size + check->csize - 1) / check->csize;
+      if (claim_chain(check, entry->starting_cluster, path) != want) {
+        check->size_mismatches++;
+        check_error(check, path, "chain length doesn't match size");
+      }
+    }
+    free(path);
+  }
+  free(data);
+}
+
+static void run_check(Image *image) {
+  Cursor *cursor = &image->cursor;
+  BPB *bpb = cursor->bpb;
+  Check check;
+  memset(&check, 0, sizeof(check));
+  check.image = image;
+  check.fat = load_fat(cursor);
+  check.last = cluster_count(bpb) + 2;
+  check.csize = cluster_size(bpb);
+  check.owned = calloc(check.last, 1);
+
+  char *errors;
+  size_t size;
+  check.errors = open_memstream(&errors, &size);
+  check_dir(&check, 0, "", 0);
+
+  // Every FAT copy should match the first
+  uint32_t fat_length = fat_size(bpb) * bpb->bytes_per_sector, copies_differ = 0, lost = 0, c;
+  char *copy = malloc(fat_length);
+  int i;
+  for (i = 1; i < bpb->table_count; i++) {
+    uint32_t address = bpb->reserved_sector_count * bpb->bytes_per_sector + i * fat_length;
+    if (!read_data(cursor, address, fat_length, copy) || memcmp(copy, check.fat, fat_length) != 0)
+      copies_differ++;
+  }
+  free(copy);
+  for (c = 2; c < check.last; c++) {
+    if (check.fat[c] != 0 && check.fat[c] != 0xFFF7 && !check.owned[c]) lost++;
+  }
+  fclose(check.errors);
+
+  bool ok = !copies_differ && !lost && !check.cross_linked && !check.bad_chains && !check.size_mismatches;
+  add_line(image, format_line(image, NULL,
+      ", \"ok\": %s, \"files\": %u, \"directories\": %u, \"fat_copies_differ\": %u, "
+      "\"cross_linked\": %u, \"bad_chains\": %u, \"size_mismatches\": %u, \"lost_clusters\": %u, "
+      "\"errors\": [%s]",
+      ok ? "true" : "false", check.files, check.directories, copies_differ, check.cross_linked,
+      check.bad_chains, check.size_mismatches, lost, errors));
+  if (!ok) __sync_fetch_and_add(&image->batch->failed, 1);
+  free(errors);
+  free(check.owned);
+}
+
+/********** Scheduling ***********/
+
+static void image_task(void *arg) {
+  Image *image = arg;
+  Batch *batch = image->batch;
+  int i;
+
+  if (!open_image(image)) {
+    add_line(image, format_line(image, NULL, ", \"error\": \"not a readable FAT16 image\""));
+    __sync_fetch_and_add(&batch->failed, 1);
+    finish_image(image);
+    return;
+  }
+  if (batch->op == OP_CHECK) {
+    run_check(image);
+    finish_image(image);
+    return;
+  }
+
+  walk_files(&image->cursor, 0, "", true, &image->list);
+  if (batch->op == OP_LIST || image->list.count == 0) {
+    for (i = 0; batch->op == OP_LIST && i < image->list.count; i++) {
+      FileRef *file = &image->list.files[i];
+      add_line(image, format_line(image, file->path, ", \"size\": %u, \"cluster\": %u",
+          file->entry.size, file->entry.starting_cluster));
+    }
+    finish_image(image);
+    return;
+  }
+
+  // Lines are filled in by index so they come out in walk order
+  image->lines = calloc(image->list.count, sizeof(char *));
+  image->line_count = image->list.count;
+  image->workers = image->list.count < batch->per_image ? image->list.count : batch->per_image;
+  int workers = image->workers;
+  for (i = 0; i < workers; i++) pool_submit(batch->pool, file_worker, image);
+}
+
+static void start_next_image(Batch *batch) {
+  pthread_mutex_lock(&batch->lock);
+  int i = batch->next_image < batch->count ? batch->next_image++ : -1;
+  pthread_mutex_unlock(&batch->lock);
+  if (i >= 0) pool_submit(batch->pool, image_task, &batch->images[i]);
+}
+
+static void add_image(Batch *batch, const char *path) {
+  batch->images = realloc(batch->images, sizeof(Image) * (batch->count + 1));
+  Image *image = &batch->images[batch->count++];
+  memset(image, 0, sizeof(Image));
+  image->batch = batch;
+  image->path = strdup(path);
+  pthread_mutex_init(&image->lock, NULL);
+}
+
+static const char *base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static int compare_names(const void *a, const void *b) {
+  const Image *x = *(Image *const *)a, *y = *(Image *const *)b;
+  int order = strcmp(base_name(x->path), base_name(y->path));
+  return order ? order : (x < y ? -1 : x > y);
+}
+
+// Gives each image its own directory under out_dir: its file name, with
+// .1, .2, ... in image order when several images share that name
+static void name_outputs(Batch *batch) {
+  Image **sorted = malloc(sizeof(Image *) * (batch->count ? batch->count : 1));
+  int i, n = 0;
+  for (i = 0; i < batch->count; i++) sorted[i] = &batch->images[i];
+  qsort(sorted, batch->count, sizeof(Image *), compare_names);
+  for (i = 0; i < batch->count; i++) {
+    const char *name = base_name(sorted[i]->path);
+    bool shared = (i > 0 && strcmp(name, base_name(sorted[i - 1]->path)) == 0) ||
+        (i + 1 < batch->count && strcmp(name, base_name(sorted[i + 1]->path)) == 0);
+    n = i > 0 && strcmp(name, base_name(sorted[i - 1]->path)) == 0 ? n + 1 : 1;
+    sorted[i]->out_name = malloc(strlen(name) + 12);
+    if (shared) sprintf(sorted[i]->out_name, "%s.%d", name, n);
+    else strcpy(sorted[i]->out_name, name);
+  }
+  free(sorted);
+}
+
+static bool parse_op(const char *name, Operation *op) {
+  if (strcmp(name, "list") == 0) *op = OP_LIST;
+  else if (strcmp(name, "hash") == 0) *op = OP_HASH;
+  else if (strcmp(name, "check") == 0) *op = OP_CHECK;
+  else if (strcmp(name, "extract") == 0) *op = OP_EXTRACT;
+  else return false;
+  return true;
+}
+
+static void free_images(Batch *batch) {
+  int i;
+  for (i = 0; i < batch->count; i++) {
+    free(batch->images[i].path);
+    free(batch->images[i].out_name);
+  }
+  free(batch->images);
+}
+
+// fat --batch <list|hash|check|extract> [-x] [-j <tasks per image>]
+//     [-o <dir>] <image>... ; exits 1 if any image failed and 2 on a
+//     usage error
+int run_batch(int argc, char **argv) {
+  Batch batch;
+  int i;
+  memset(&batch, 0, sizeof(batch));
+  batch.per_image = DEFAULT_PER_IMAGE;
+  if (argc < 1 || !parse_op(argv[0], &batch.op)) {
+    disp_error(CODE_5, NULL, 0);
+    return 2;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-x") == 0) batch.use_xxh = true;
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) batch.per_image = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) batch.out_dir = argv[++i];
+    else if (strcmp(argv[i], "-") == 0) {
+      char line[4096];
+      while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0]) add_image(&batch, line);
+      }
+    } else {
+      add_image(&batch, argv[i]);
+    }
+  }
+  if (batch.per_image < 1 || (batch.op == OP_EXTRACT && !batch.out_dir)) {
+    disp_error(CODE_5, NULL, 0);
+    free_images(&batch);
+    return 2;
+  }
+  if (batch.out_dir) mkdir(batch.out_dir, 0755);
+  if (batch.op == OP_EXTRACT) name_outputs(&batch);
+
+  pthread_mutex_init(&batch.lock, NULL);
+  batch.pool = pool_create(pool_default_threads());
+  for (i = 0; i < batch.count && i < MAX_OPEN_IMAGES; i++) start_next_image(&batch);
+  pool_wait(batch.pool);
+  pool_destroy(batch.pool);
+  pthread_mutex_destroy(&batch.lock);
+
+  free_images(&batch);
+  return batch.failed ? 1 : 0;
+}
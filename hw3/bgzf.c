@@ -0,0 +1,290 @@
+#include "device.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// Read-only device over a BGZF-compressed image (bgzip's blocked gzip).
+// The file is a series of independent gzip members of at most 64 KiB of
+// image each, and every member's header records its compressed size, so
+// the frames can be indexed without decompressing anything. The index
+// comes from a bgzip .gzi sidecar when there is one and from walking the
+// member headers otherwise. Decompressed frames are kept in a small LRU
+// cache, so reading metadata or one file only inflates the frames that
+// hold it.
+
+#define BGZF_HEADER 18
+#define BGZF_MAX_FRAME 65536
+#define FRAME_CACHE 64
+#define GZI_SUFFIX ".gzi"
+
+typedef struct {
+  uint64_t offset;            // in the compressed file
+  uint64_t start;             // in the image
+  uint32_t compressed;
+  uint32_t length;
+} Frame;
+
+typedef struct {
+  int64_t frame;              // -1 when empty
+  uint64_t used;
+  char *data;
+} FrameLine;
+
+typedef struct {
+  Device base;
+  int fd;
+  Frame *frames;
+  uint32_t count;
+  uint64_t size;
+
+  pthread_mutex_t lock;
+  FrameLine lines[FRAME_CACHE];
+  uint64_t clock;
+} Bgzf;
+
+// Returns a member's compressed size from its header, or 0 if the bytes
+// at offset aren't a BGZF member
+static uint32_t member_size(const unsigned char *h) {
+  if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)) return 0;
+  if (h[10] + (h[11] << 8) != 6 || h[12] != 'B' || h[13] != 'C' || h[14] + (h[15] << 8) != 2) return 0;
+  return (h[16] + (h[17] << 8)) + 1;
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void add_frame(Bgzf *bgzf, uint32_t *capacity, uint64_t offset, uint64_t start,
+    uint32_t compressed, uint32_t length) {
+  if (bgzf->count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 256;
+    bgzf->frames = realloc(bgzf->frames, sizeof(Frame) * *capacity);
+  }
+  Frame frame = { offset, start, compressed, length };
+  bgzf->frames[bgzf->count++] = frame;
+}
+
+// Reads a member's header and trailer to find its sizes
+static bool probe_member(int fd, uint64_t offset, uint64_t file_size, uint32_t *compressed, uint32_t *length) {
+  unsigned char header[BGZF_HEADER], trailer[4];
+  if (offset + BGZF_HEADER > file_size || !fd_read(fd, offset, BGZF_HEADER, header)) return false;
+  *compressed = member_size(header);
+  if (!*compressed || offset + *compressed > file_size) return false;
+  if (!fd_read(fd, offset + *compressed - 4, 4, trailer)) return false;
+  *length = read_le32(trailer);
+  return *length <= BGZF_MAX_FRAME;
+}
+
+static bool scan_members(Bgzf *bgzf, uint64_t file_size) {
+  uint32_t capacity = 0, compressed, length;
+  uint64_t offset = 0, start = 0;
+  while (offset < file_size) {
+    if (!probe_member(bgzf->fd, offset, file_size, &compressed, &length)) return false;
+    if (length) add_frame(bgzf, &capacity, offset, start, compressed, length);
+    offset += compressed;
+    start += length;
+  }
+  bgzf->size = start;
+  return bgzf->count > 0;
+}
+
+// A .gzi holds a count and then (compressed, uncompressed) offset pairs
+// for every member after the first
+static bool load_gzi(Bgzf *bgzf, const char *path, uint64_t file_size) {
+  char *gzi_path = sidecar_path(path, GZI_SUFFIX);
+  FILE *gzi = fopen(gzi_path, "rb");
+  free(gzi_path);
+  if (!gzi) return false;
+
+  uint64_t entries, i;
+  uint64_t *pairs = NULL;
+  bool ok = fread(&entries, sizeof(entries), 1, gzi) == 1 && entries < file_size;
+  if (ok) {
+    pairs = malloc(sizeof(uint64_t) * 2 * (entries + 1));
+    pairs[0] = pairs[1] = 0;
+    ok = fread(pairs + 2, sizeof(uint64_t) * 2, entries, gzi) == entries;
+  }
+  fclose(gzi);
+
+  // Sizes come from the gaps between entries; only the last member is probed
+  uint32_t capacity = 0;
+  for (i = 0; ok && i < entries; i++) {
+    uint64_t compressed = pairs[2 * i + 2] - pairs[2 * i], length = pairs[2 * i + 3] - pairs[2 * i + 1];
+    ok = pairs[2 * i + 2] > pairs[2 * i] && length <= BGZF_MAX_FRAME && pairs[2 * i + 2] <= file_size;
+    if (ok && length) add_frame(bgzf, &capacity, pairs[2 * i], pairs[2 * i + 1], compressed, length);
+  }
+  uint32_t compressed, length;
+  ok = ok && probe_member(bgzf->fd, pairs[2 * entries], file_size, &compressed, &length);
+  if (ok) {
+    if (length) add_frame(bgzf, &capacity, pairs[2 * entries], pairs[2 * entries + 1], compressed, length);
+    bgzf->size = pairs[2 * entries + 1] + length;
+  }
+  free(pairs);
+  if (!ok) {
+    free(bgzf->frames);
+    bgzf->frames = NULL;
+    bgzf->count = 0;
+  }
+  return ok && bgzf->count > 0;
+}
+
+/********** Frames ***********/
+
+static bool inflate_frame(Bgzf *bgzf, Frame *frame, char *out) {
+  unsigned char *in = malloc(frame->compressed);
+  bool ok = fd_read(bgzf->fd, frame->offset, frame->compressed, in);
+  if (ok) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    ok = inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK;
+    if (ok) {
+      stream.next_in = in;
+      stream.avail_in = frame->compressed;
+      stream.next_out = (Bytef *)out;
+      stream.avail_out = frame->length;
+      ok = inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == frame->length;
+      inflateEnd(&stream);
+    }
+  }
+  free(in);
+  return ok;
+}
+
+static uint32_t find_frame(Bgzf *bgzf, uint64_t offset) {
+  uint32_t low = 0, high = bgzf->count;
+  while (high - low > 1) {
+    uint32_t mid = (low + high) / 2;
+    if (bgzf->frames[mid].start <= offset) low = mid;
+    else high = mid;
+  }
+  return low;
+}
+
+// Copies part of frame f into buf. Frames are inflated outside the lock so
+// readers on other threads aren't held up; if two threads race to inflate
+// the same frame, one copy is simply dropped.
+static bool copy_from_frame(Bgzf *bgzf, uint32_t f, uint32_t skip, uint32_t length, char *buf) {
+  int i, victim = 0;
+  pthread_mutex_lock(&bgzf->lock);
+  for (i = 0; i < FRAME_CACHE; i++) {
+    if (bgzf->lines[i].frame == f) {
+      bgzf->lines[i].used = ++bgzf->clock;
+      memcpy(buf, bgzf->lines[i].data + skip, length);
+      pthread_mutex_unlock(&bgzf->lock);
+      return true;
+    }
+  }
+  pthread_mutex_unlock(&bgzf->lock);
+
+  char *data = malloc(BGZF_MAX_FRAME);
+  if (!inflate_frame(bgzf, &bgzf->frames[f], data)) {
+    free(data);
+    return false;
+  }
+  memcpy(buf, data + skip, length);
+
+  pthread_mutex_lock(&bgzf->lock);
+  for (i = 0; i < FRAME_CACHE; i++) {
+    if (bgzf->lines[i].frame == f) break;
+    if (bgzf->lines[i].used < bgzf->lines[victim].used) victim = i;
+  }
+  if (i == FRAME_CACHE) {
+    free(bgzf->lines[victim].data);
+    bgzf->lines[victim].frame = f;
+    bgzf->lines[victim].data = data;
+    bgzf->lines[victim].used = ++bgzf->clock;
+    data = NULL;
+  }
+  pthread_mutex_unlock(&bgzf->lock);
+  free(data);
+  return true;
+}
+
+/********** Device ***********/
+
+static bool bgzf_read(Device *dev, uint64_t offset, uint32_t length, void *buf) {
+  Bgzf *bgzf = (Bgzf *)dev;
+  uint32_t done = 0;
+  while (done < length && offset + done < bgzf->size) {
+    uint32_t f = find_frame(bgzf, offset + done);
+    Frame *frame = &bgzf->frames[f];
+    uint32_t skip = offset + done - frame->start;
+    uint32_t take = frame->length - skip < length - done ? frame->length - skip : length - done;
+    if (!copy_from_frame(bgzf, f, skip, take, (char *)buf + done)) return false;
+    done += take;
+  }
+  // Reading past the end of the image yields zeroes
+  if (done < length) memset((char *)buf + done, 0, length - done);
+  return true;
+}
+
+static bool bgzf_write(Device *dev, uint64_t offset, uint32_t length, const void *buf) {
+  (void)dev;
+  (void)offset;
+  (void)length;
+  (void)buf;
+  return false;
+}
+
+static bool bgzf_writev(Device *dev, uint64_t offset, const struct iovec *iov, int count) {
+  (void)dev;
+  (void)offset;
+  (void)iov;
+  (void)count;
+  return false;
+}
+
+static bool bgzf_sync(Device *dev) {
+  (void)dev;
+  return true;
+}
+
+static void bgzf_close(Device *dev) {
+  Bgzf *bgzf = (Bgzf *)dev;
+  int i;
+  for (i = 0; i < FRAME_CACHE; i++) free(bgzf->lines[i].data);
+  pthread_mutex_destroy(&bgzf->lock);
+  free(bgzf->frames);
+  close(bgzf->fd);
+  free(bgzf);
+}
+
+bool is_bgzf(const char *path) {
+  unsigned char header[BGZF_HEADER];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  bool ok = read(fd, header, BGZF_HEADER) == BGZF_HEADER && member_size(header) != 0;
+  close(fd);
+  return ok;
+}
+
+Device *bgzf_device_open(const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  Bgzf *bgzf = calloc(1, sizeof(Bgzf));
+  int i;
+  bgzf->fd = fd;
+  if (!load_gzi(bgzf, path, st.st_size) && !scan_members(bgzf, st.st_size)) {
+    free(bgzf->frames);
+    free(bgzf);
+    close(fd);
+    return NULL;
+  }
+  for (i = 0; i < FRAME_CACHE; i++) bgzf->lines[i].frame = -1;
+  pthread_mutex_init(&bgzf->lock, NULL);
+
+  bgzf->base.read = bgzf_read;
+  bgzf->base.write = bgzf_write;
+  bgzf->base.writev = bgzf_writev;
+  bgzf->base.sync = bgzf_sync;
+  bgzf->base.close = bgzf_close;
+  bgzf->base.writable = false;
+  return &bgzf->base;
+}
@@ -0,0 +1,341 @@
+#include "cache.h"
+#include <limits.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+Cache *cache_create(Device *device, BPB *bpb, uint32_t capacity, char *journal) {
+  Cache *cache = calloc(1, sizeof(Cache));
+  uint32_t buckets = 16;
+  while (buckets < capacity) buckets <<= 1;
+
+  cache->device = device;
+  cache->sector_size = bpb->bytes_per_sector;
+  cache->capacity = capacity;
+  cache->buckets = calloc(buckets, sizeof(CacheLine *));
+  cache->bucket_mask = buckets - 1;
+  cache->fat_first = bpb->reserved_sector_count;
+  cache->fat_sectors = bpb->table_size_16;
+  cache->fat_copies = bpb->table_count;
+  cache->journal = journal;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void cache_destroy(Cache *cache) {
+  CacheLine *line = cache->head;
+  while (line) {
+    CacheLine *next = line->next;
+    free(line->data);
+    free(line);
+    line = next;
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->journal);
+  free(cache->buckets);
+  free(cache);
+}
+
+// Sectors of later FAT copies are cached as the first copy's
+static uint32_t map_sector(Cache *cache, uint32_t sector) {
+  uint32_t fat_end = cache->fat_first + cache->fat_copies * cache->fat_sectors;
+  if (sector >= cache->fat_first + cache->fat_sectors && sector < fat_end)
+    return cache->fat_first + (sector - cache->fat_first) % cache->fat_sectors;
+  return sector;
+}
+
+static bool is_fat_sector(Cache *cache, uint32_t sector) {
+  return sector >= cache->fat_first && sector < cache->fat_first + cache->fat_sectors;
+}
+
+/********** Lines ***********/
+
+static uint32_t bucket_of(Cache *cache, uint32_t sector) {
+  return (sector * 2654435761u) & cache->bucket_mask;
+}
+
+static CacheLine *lookup(Cache *cache, uint32_t sector) {
+  CacheLine *line = cache->buckets[bucket_of(cache, sector)];
+  while (line && line->sector != sector) line = line->chain;
+  return line;
+}
+
+static void unlink_lru(Cache *cache, CacheLine *line) {
+  if (line->prev) line->prev->next = line->next;
+  else cache->head = line->next;
+  if (line->next) line->next->prev = line->prev;
+  else cache->tail = line->prev;
+}
+
+static void push_front(Cache *cache, CacheLine *line) {
+  line->prev = NULL;
+  line->next = cache->head;
+  if (cache->head) cache->head->prev = line;
+  cache->head = line;
+  if (!cache->tail) cache->tail = line;
+}
+
+static void touch(Cache *cache, CacheLine *line) {
+  if (cache->head == line) return;
+  unlink_lru(cache, line);
+  push_front(cache, line);
+}
+
+static void remove_line(Cache *cache, CacheLine *line) {
+  CacheLine **link = &cache->buckets[bucket_of(cache, line->sector)];
+  while (*link != line) link = &(*link)->chain;
+  *link = line->chain;
+  unlink_lru(cache, line);
+  cache->count--;
+  cache->generation++;
+  free(line->data);
+  free(line);
+}
+
+// Makes room for one more line by dropping the oldest clean one. When
+// every line is dirty the cache grows instead: flushing here would split
+// an operation's metadata across two batches.
+static void evict(Cache *cache) {
+  CacheLine *line;
+  if (cache->count < cache->capacity) return;
+  for (line = cache->tail; line; line = line->prev) {
+    if (!line->dirty) {
+      remove_line(cache, line);
+      return;
+    }
+  }
+}
+
+static CacheLine *insert(Cache *cache, uint32_t sector, const char *data) {
+  evict(cache);
+  CacheLine *line = calloc(1, sizeof(CacheLine));
+  line->sector = sector;
+  line->data = malloc(cache->sector_size);
+  memcpy(line->data, data, cache->sector_size);
+  uint32_t b = bucket_of(cache, sector);
+  line->chain = cache->buckets[b];
+  cache->buckets[b] = line;
+  push_front(cache, line);
+  cache->count++;
+  return line;
+}
+
+// Returns the line for sector, reading it and the missing sectors after it
+// (up to last) from the image in one go on a miss. Called with the lock
+// held; the lock is dropped for the read so other threads can use the
+// cache meanwhile, the way bgzf.c inflates frames. A read that may have
+// gone stale while unlocked is thrown away and retried.
+static CacheLine *fetch(Cache *cache, uint32_t sector, uint32_t last) {
+  uint32_t mapped = map_sector(cache, sector);
+  for (;;) {
+    CacheLine *line = lookup(cache, mapped);
+    if (line) {
+      touch(cache, line);
+      return line;
+    }
+
+    uint32_t run = 1;
+    while (sector + run <= last && map_sector(cache, sector + run) == mapped + run &&
+        !lookup(cache, mapped + run) && run < cache->capacity / 2)
+      run++;
+    char *buf = malloc(run * cache->sector_size);
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+    bool ok = read_bytes(cache->device, mapped * cache->sector_size, run * cache->sector_size, buf);
+    pthread_mutex_lock(&cache->lock);
+    if (!ok) {
+      free(buf);
+      return NULL;
+    }
+    if (cache->generation != generation) {
+      free(buf);
+      continue;
+    }
+
+    // Insert back to front so the first sector ends up most recent. Lines
+    // another thread loaded meanwhile are newer than ours, or the same.
+    uint32_t i;
+    for (i = run; i-- > 0;) {
+      if (!lookup(cache, mapped + i)) insert(cache, mapped + i, buf + i * cache->sector_size);
+    }
+    free(buf);
+  }
+}
+
+/********** Access ***********/
+
+bool cache_read(Cache *cache, uint32_t offset, uint32_t length, void *buf) {
+  uint32_t size = cache->sector_size;
+  uint32_t last = length ? (offset + length - 1) / size : 0;
+  uint32_t done = 0;
+  bool ok = true;
+
+  pthread_mutex_lock(&cache->lock);
+  while (done < length) {
+    uint32_t sector = (offset + done) / size;
+    uint32_t skip = (offset + done) % size;
+    uint32_t take = size - skip < length - done ? size - skip : length - done;
+    CacheLine *line = fetch(cache, sector, last);
+    if (!line) {
+      ok = false;
+      break;
+    }
+    memcpy((char *)buf + done, line->data + skip, take);
+    done += take;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return ok;
+}
+
+bool cache_write(Cache *cache, uint32_t offset, uint32_t length, const void *buf) {
+  uint32_t size = cache->sector_size;
+  uint32_t done = 0;
+  bool ok = true;
+
+  pthread_mutex_lock(&cache->lock);
+  while (done < length) {
+    uint32_t sector = (offset + done) / size;
+    uint32_t skip = (offset + done) % size;
+    uint32_t take = size - skip < length - done ? size - skip : length - done;
+    uint32_t mapped = map_sector(cache, sector);
+    CacheLine *line = lookup(cache, mapped);
+
+    // Whole sectors don't need to be read first
+    if (line) touch(cache, line);
+    else if (take == size) line = insert(cache, mapped, (const char *)buf + done);
+    else line = fetch(cache, sector, sector);
+    if (!line) {
+      ok = false;
+      break;
+    }
+
+    memcpy(line->data + skip, (const char *)buf + done, take);
+    if (!line->dirty) cache->dirty_count++;
+    line->dirty = true;
+    done += take;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return ok;
+}
+
+// Calls visit for every cached line overlapping [offset, offset + length)
+static void overlapping(Cache *cache, uint32_t offset, uint32_t length, bool dirty_only,
+    void (*visit)(Cache *cache, CacheLine *line, uint32_t line_offset, uint32_t offset, uint32_t length, void *buf),
+    void *buf) {
+  uint32_t size = cache->sector_size;
+  uint32_t sector, first = offset / size, last = (offset + length - 1) / size;
+  if (!length) return;
+
+  pthread_mutex_lock(&cache->lock);
+  if (!dirty_only) cache->generation++;
+  if (!dirty_only || cache->dirty_count) {
+    for (sector = first; sector <= last; sector++) {
+      CacheLine *line = lookup(cache, map_sector(cache, sector));
+      if (!line || (dirty_only && !line->dirty)) continue;
+      visit(cache, line, sector * size, offset, length, buf);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Copies between a line and buf over the range the two share
+static void shared_range(uint32_t size, uint32_t line_offset, uint32_t offset, uint32_t length,
+    uint32_t *line_skip, uint32_t *buf_skip, uint32_t *count) {
+  uint32_t start = line_offset > offset ? line_offset : offset;
+  uint32_t end = line_offset + size < offset + length ? line_offset + size : offset + length;
+  *line_skip = start - line_offset;
+  *buf_skip = start - offset;
+  *count = end - start;
+}
+
+static void patch_line(Cache *cache, CacheLine *line, uint32_t line_offset, uint32_t offset,
+    uint32_t length, void *buf) {
+  uint32_t line_skip, buf_skip, count;
+  shared_range(cache->sector_size, line_offset, offset, length, &line_skip, &buf_skip, &count);
+  memcpy((char *)buf + buf_skip, line->data + line_skip, count);
+}
+
+static void update_line(Cache *cache, CacheLine *line, uint32_t line_offset, uint32_t offset,
+    uint32_t length, void *buf) {
+  uint32_t line_skip, buf_skip, count;
+  shared_range(cache->sector_size, line_offset, offset, length, &line_skip, &buf_skip, &count);
+  memcpy(line->data + line_skip, (char *)buf + buf_skip, count);
+}
+
+void cache_patch(Cache *cache, uint32_t offset, uint32_t length, void *buf) {
+  overlapping(cache, offset, length, true, patch_line, buf);
+}
+
+void cache_update(Cache *cache, uint32_t offset, uint32_t length, const void *buf) {
+  overlapping(cache, offset, length, false, update_line, (void *)buf);
+}
+
+/********** Flush ***********/
+
+static int compare_targets(const void *a, const void *b) {
+  uint32_t x = ((const SectorWrite *)a)->sector, y = ((const SectorWrite *)b)->sector;
+  return x < y ? -1 : x > y;
+}
+
+// Adjacent sectors go out in a single gathered write
+static bool write_targets(Cache *cache, SectorWrite *targets, uint32_t count) {
+  uint32_t size = cache->sector_size, i = 0;
+  struct iovec iov[IOV_MAX];
+  bool ok = true;
+  while (i < count && ok) {
+    uint32_t first = targets[i].sector, n = 0;
+    while (i < count && n < IOV_MAX && targets[i].sector == first + n) {
+      iov[n].iov_base = targets[i].data;
+      iov[n].iov_len = size;
+      n++;
+      i++;
+    }
+    ok = cache->device->writev(cache->device, (uint64_t)first * size, iov, n);
+  }
+  return ok;
+}
+
+static bool flush_locked(Cache *cache) {
+  if (!cache->dirty_count) return true;
+
+  // Every dirty sector, plus its mirrors in the other FAT copies
+  SectorWrite *targets = malloc(sizeof(SectorWrite) * cache->dirty_count * (cache->fat_copies + 1));
+  uint32_t count = 0, k;
+  CacheLine *line;
+  for (line = cache->head; line; line = line->next) {
+    if (!line->dirty) continue;
+    targets[count].sector = line->sector;
+    targets[count++].data = line->data;
+    if (!is_fat_sector(cache, line->sector)) continue;
+    for (k = 1; k < cache->fat_copies; k++) {
+      targets[count].sector = line->sector + k * cache->fat_sectors;
+      targets[count++].data = line->data;
+    }
+  }
+  qsort(targets, count, sizeof(SectorWrite), compare_targets);
+
+  // Data written around the cache has to be durable before the metadata
+  // that points at it, and the batch before any of it lands on the image
+  bool ok = true;
+  if (cache->journal)
+    ok = cache->device->sync(cache->device) && journal_commit(cache->journal, cache->sector_size, targets, count);
+  ok = ok && write_targets(cache, targets, count);
+  if (cache->journal) ok = ok && cache->device->sync(cache->device) && journal_clear(cache->journal);
+  free(targets);
+  if (!ok) {
+    disp_error(CODE_9, NULL, 0);
+    return false;
+  }
+
+  for (line = cache->head; line; line = line->next) line->dirty = false;
+  cache->dirty_count = 0;
+  return true;
+}
+
+bool cache_flush(Cache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  bool ok = flush_locked(cache);
+  pthread_mutex_unlock(&cache->lock);
+  return ok;
+}
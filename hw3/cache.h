@@ -0,0 +1,70 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "fat.h"
+#include "journal.h"
+#include "device.h"
+#include <pthread.h>
+
+// Write-back sector cache for image metadata. Lines are evicted in LRU
+// order; dirty lines are only written by cache_flush, which sorts them by
+// offset and merges neighbours into single writes. The FAT copies share
+// one set of lines: writes to any copy land on the first, and flushing a
+// FAT sector writes it to every copy in the same pass.
+//
+// Dirty lines are never evicted, so everything written between two
+// flushes reaches the image as one batch, through the journal when the
+// cache has one.
+
+#define CACHE_SECTORS 4096
+
+typedef struct cache_line_t {
+  uint32_t sector;
+  bool dirty;
+  char *data;
+
+  struct cache_line_t *prev;    // LRU order, most recent first
+  struct cache_line_t *next;
+  struct cache_line_t *chain;   // hash bucket
+} CacheLine;
+
+struct cache_t {
+  Device *device;
+  uint32_t sector_size;
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t dirty_count;
+
+  CacheLine **buckets;
+  uint32_t bucket_mask;
+  CacheLine *head;
+  CacheLine *tail;
+
+  // FAT copies, in sectors
+  uint32_t fat_first;
+  uint32_t fat_sectors;
+  uint32_t fat_copies;
+
+  char *journal;                // NULL writes straight to the image
+  pthread_mutex_t lock;
+
+  // Bumped whenever a sector may have changed on the image without a line
+  // to show it, so a miss read without the lock can tell it went stale
+  uint64_t generation;
+};
+
+Cache *cache_create(Device *device, BPB *bpb, uint32_t capacity, char *journal);
+void cache_destroy(Cache *cache);
+
+bool cache_read(Cache *cache, uint32_t offset, uint32_t length, void *buf);
+bool cache_write(Cache *cache, uint32_t offset, uint32_t length, const void *buf);
+
+// Overlays dirty lines onto data read straight from the image
+void cache_patch(Cache *cache, uint32_t offset, uint32_t length, void *buf);
+
+// Refreshes any cached copies of sectors that were written around the cache
+void cache_update(Cache *cache, uint32_t offset, uint32_t length, const void *buf);
+
+bool cache_flush(Cache *cache);
+
+#endif
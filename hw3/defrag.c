@@ -0,0 +1,593 @@
+#include "fat.h"
+#include <stddef.h>
+
+// Defragmenter (defrag). Every file and directory is first moved whole
+// into the free run that fits it best if it is fragmented, and then slid
+// down into the lowest free run that can hold it, compacting the data
+// area. Both passes repeat until nothing moves. The root directory has a
+// fixed place on FAT16 and never moves.
+//
+// A move never touches live data: the clusters are copied into free space
+// and synced, then a record of the move goes to a sidecar log next to the
+// image, and only then are the FAT copies and the entry switched over.
+// The record holds the old chain, so replay_move_log can finish or undo
+// an interrupted move from whatever state the entry is found in.
+//
+// Moves are committed in batches of up to MAX_BATCH_MOVES, so the syncs
+// and the log write are paid once per batch rather than once per file. A
+// batch is committed early when a move would land on clusters another
+// move in it is leaving, or would move the same file twice, so the moves
+// in one log never overlap and each can be replayed on its own.
+//
+// A directory's clusters are also pointed at by its own "." entry and the
+// ".." entry of each subdirectory. Their addresses go in the record too,
+// and are switched over along with the entry. A directory holds entries
+// that other moves update, so it is always moved in a batch of its own.
+
+#define MOVE_LOG_SUFFIX ".defrag"
+#define MOVE_LOG_MAGIC 0x32524644
+#define COPY_BATCH (4 * 1024 * 1024)
+#define MAX_BATCH_MOVES 256
+
+typedef struct {
+  uint32_t magic;
+  uint32_t entry_address;
+  uint16_t old_start;
+  uint16_t new_start;
+  uint32_t length;        // clusters; the old chain follows the record
+  uint32_t links;         // "." and ".." entries; their addresses follow the chain
+} __attribute((packed)) MoveRecord;
+
+typedef struct {
+  FileRef *file;
+  uint16_t start;
+  uint32_t clusters;
+  int extents;
+} Layout;
+
+typedef struct {
+  MoveRecord rec;
+  uint16_t *old;
+  uint32_t *links;
+  Layout *layout;
+} PendingMove;
+
+// Moves copied but not yet switched over on the image. The in-memory FAT
+// already shows them done, so planning sees the layout they leave behind.
+typedef struct {
+  Cursor *cursor;
+  char *buf;              // COPY_BATCH bytes for copy_clusters
+  PendingMove moves[MAX_BATCH_MOVES];
+  int count;
+  uint8_t *leaving;       // old chains of pending moves, still live on the image
+  bool failed;
+
+  // Entries inside a moved directory are found through these
+  FileList *files;
+  FileList *dirs;
+} MoveBatch;
+
+// Returns the file's chain, or NULL when it doesn't match the file's size.
+// A directory has no size; its chain must end properly instead.
+static uint16_t *get_chain(Cursor *cursor, Fat16Entry *entry, uint32_t *length) {
+  uint16_t *fat = load_fat(cursor);
+  uint32_t csize = cluster_size(cursor->bpb);
+  uint32_t last = cluster_count(cursor->bpb) + 2;
+  bool directory = entry->attributes & DIR_ATTR_DIRECTORY;
+  uint32_t want = directory ? last - 2 : (entry->size + csize - 1) / csize;
+  uint16_t *chain = malloc(sizeof(uint16_t) * (want + 1));
+  uint16_t c = entry->starting_cluster;
+  uint32_t n = 0;
+
+  while (c >= 2 && c < 0xFFF8 && n < want) {
+    if (c >= last) break;
+    chain[n++] = c;
+    c = fat[c];
+  }
+  if (directory ? n == 0 || c < 0xFFF8 : n != want || (c >= 2 && c < 0xFFF8)) {
+    free(chain);
+    return NULL;
+  }
+  *length = n;
+  return chain;
+}
+
+static int count_extents(uint16_t *chain, uint32_t length) {
+  uint32_t i;
+  int extents = length ? 1 : 0;
+  for (i = 1; i < length; i++) {
+    if (chain[i] != chain[i - 1] + 1) extents++;
+  }
+  return extents;
+}
+
+/********** Applying moves ***********/
+
+static void mark_dirty(Cursor *cursor, bool *dirty, uint16_t cluster) {
+  dirty[cluster * 2 / cursor->bpb->bytes_per_sector] = true;
+}
+
+// Writes each run of dirty FAT sectors to every FAT copy
+static bool flush_dirty(Cursor *cursor, bool *dirty) {
+  uint32_t sectors = fat_size(cursor->bpb), s = 0;
+  bool ok = true;
+  while (s < sectors) {
+    if (!dirty[s]) {
+      s++;
+      continue;
+    }
+    uint32_t first = s;
+    while (s < sectors && dirty[s]) dirty[s++] = false;
+    ok = store_fat_sectors(cursor, first, s - first) && ok;
+  }
+  return ok;
+}
+
+// Points each of a directory's "." and ".." links at start
+static bool write_links(Cursor *cursor, MoveRecord *rec, uint32_t *links, uint16_t start) {
+  uint32_t i;
+  bool ok = true;
+  for (i = 0; i < rec->links; i++)
+    ok = write_meta(cursor, links[i] + offsetof(Fat16Entry, starting_cluster), sizeof(start), &start) && ok;
+  return ok;
+}
+
+// Links the new run, points the entry at it and frees the old chain.
+// Safe to repeat, which is what replay relies on.
+static bool apply_move(Cursor *cursor, MoveRecord *rec, uint16_t *old, uint32_t *links) {
+  uint16_t *fat = load_fat(cursor);
+  bool *dirty = calloc(fat_size(cursor->bpb), sizeof(bool));
+  uint32_t i;
+  bool ok;
+
+  for (i = 0; i < rec->length; i++) {
+    uint16_t c = rec->new_start + i;
+    fat[c] = (i + 1 < rec->length) ? c + 1 : 0xFFFF;
+    mark_dirty(cursor, dirty, c);
+  }
+  ok = flush_dirty(cursor, dirty);
+  ok = ok && write_meta(cursor, rec->entry_address + offsetof(Fat16Entry, starting_cluster),
+      sizeof(uint16_t), &rec->new_start);
+  ok = ok && write_links(cursor, rec, links, rec->new_start);
+  for (i = 0; i < rec->length; i++) {
+    fat[old[i]] = 0;
+    mark_dirty(cursor, dirty, old[i]);
+  }
+  ok = ok && flush_dirty(cursor, dirty);
+  free(dirty);
+  return ok;
+}
+
+// Puts the old chain back and releases the new run
+static bool undo_move(Cursor *cursor, MoveRecord *rec, uint16_t *old, uint32_t *links) {
+  uint16_t *fat = load_fat(cursor);
+  bool *dirty = calloc(fat_size(cursor->bpb), sizeof(bool));
+  uint32_t i;
+  for (i = 0; i < rec->length; i++) {
+    fat[rec->new_start + i] = 0;
+    mark_dirty(cursor, dirty, rec->new_start + i);
+  }
+  for (i = 0; i < rec->length; i++) {
+    fat[old[i]] = (i + 1 < rec->length) ? old[i + 1] : 0xFFFF;
+    mark_dirty(cursor, dirty, old[i]);
+  }
+  bool ok = flush_dirty(cursor, dirty);
+  ok = write_links(cursor, rec, links, rec->old_start) && ok;
+  free(dirty);
+  return ok;
+}
+
+void replay_move_log(Cursor *cursor) {
+  char *path = sidecar_path(cursor->image_path, MOVE_LOG_SUFFIX);
+  FILE *log = fopen(path, "rb");
+  if (!log) {
+    free(path);
+    return;
+  }
+
+  // Read every record first; a torn log means no move in it started on
+  // the image
+  PendingMove *moves = NULL;
+  int count = 0, i;
+  bool ok = true;
+  for (;;) {
+    MoveRecord rec;
+    if (fread(&rec, sizeof(rec), 1, log) != 1) {
+      ok = feof(log) && count > 0;
+      break;
+    }
+    uint16_t *old = NULL;
+    uint32_t *links = NULL;
+    ok = rec.magic == MOVE_LOG_MAGIC && rec.length <= cluster_count(cursor->bpb) &&
+        rec.links <= rec.length * cluster_size(cursor->bpb) / sizeof(Fat16Entry) + 1;
+    if (ok) {
+      old = malloc(sizeof(uint16_t) * (rec.length + 1));
+      links = malloc(sizeof(uint32_t) * (rec.links + 1));
+      ok = fread(old, sizeof(uint16_t), rec.length, log) == rec.length &&
+          fread(links, sizeof(uint32_t), rec.links, log) == rec.links;
+    }
+    if (!ok) {
+      free(old);
+      free(links);
+      break;
+    }
+    moves = realloc(moves, sizeof(PendingMove) * (count + 1));
+    moves[count].rec = rec;
+    moves[count].old = old;
+    moves[count++].links = links;
+  }
+  fclose(log);
+
+  // The moves in one log never overlap, so each is settled on its own
+  if (ok) {
+    for (i = 0; i < count && ok; i++) {
+      uint16_t current;
+      MoveRecord *rec = &moves[i].rec;
+      read_meta(cursor, rec->entry_address + offsetof(Fat16Entry, starting_cluster),
+          sizeof(current), &current);
+      ok = current == rec->new_start ? apply_move(cursor, rec, moves[i].old, moves[i].links)
+          : undo_move(cursor, rec, moves[i].old, moves[i].links);
+    }
+    ok = ok && sync_image(cursor);
+    if (ok) printf("defrag: recovered %d interrupted moves\n", count);
+  } else {
+    ok = true;
+  }
+  if (ok) {
+    unlink(path);
+    sync_parent(path);
+  } else {
+    disp_error(CODE_9, path, 0);
+  }
+  for (i = 0; i < count; i++) {
+    free(moves[i].old);
+    free(moves[i].links);
+  }
+  free(moves);
+  free(path);
+}
+
+/********** Moving files ***********/
+
+// Slot addresses of the entries that point at a directory besides its own:
+// "." at the top of its first cluster, which lands at dest once copied,
+// and ".." in each subdirectory
+static uint32_t *find_links(Cursor *cursor, uint16_t start, uint16_t dest, uint32_t *count) {
+  BPB *bpb = cursor->bpb;
+  uint32_t last = cluster_count(bpb) + 2;
+  uint32_t length, i;
+  char *data = read_dir_data(cursor, start, &length);
+  uint32_t *links = malloc(sizeof(uint32_t) * (length / 32 + 1));
+  *count = 0;
+
+  for (i = 0; i + 32 <= length; i += 32) {
+    Fat16Entry *entry = (Fat16Entry *)(data + i);
+    if (entry->name[0] == 0) break;
+    if (i == 0 && memcmp(entry->name, ".          ", MAX_NAME_LENGTH) == 0 && entry->starting_cluster == start) {
+      links[(*count)++] = cluster_address(bpb, dest);
+      continue;
+    }
+    if (entry->name[0] == UNUSED_FLAG || entry->name[0] == '.') continue;
+    if ((entry->attributes & DIR_ATTR_LFN) == DIR_ATTR_LFN || entry->attributes & DIR_ATTR_VOLUMEID) continue;
+    if (!(entry->attributes & DIR_ATTR_DIRECTORY)) continue;
+    if (entry->starting_cluster < 2 || entry->starting_cluster >= last || entry->starting_cluster == start) continue;
+
+    Fat16Entry dotdot;
+    uint32_t address = cluster_slot_address(cursor, entry->starting_cluster, 1);
+    if (address && read_meta(cursor, address, sizeof(dotdot), &dotdot) &&
+        memcmp(dotdot.name, "..         ", MAX_NAME_LENGTH) == 0 && dotdot.starting_cluster == start)
+      links[(*count)++] = address;
+  }
+  free(data);
+  return links;
+}
+
+// Points whatever was found inside a directory at its new place
+static void moved_dir(MoveBatch *batch, uint16_t old, uint16_t dest) {
+  FileList *lists[] = { batch->files, batch->dirs };
+  EntryNode *current = batch->cursor->current;
+  int i, j;
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < lists[i]->count; j++) {
+      if (lists[i]->files[j].dir_cluster == old) lists[i]->files[j].dir_cluster = dest;
+    }
+  }
+  if (!current->isRoot && current->entry->starting_cluster == old) current->entry->starting_cluster = dest;
+}
+
+static bool copy_clusters(Cursor *cursor, uint16_t *chain, uint32_t length, uint16_t dest, char *buf) {
+  BPB *bpb = cursor->bpb;
+  uint32_t csize = cluster_size(bpb);
+  uint32_t per_batch = COPY_BATCH / csize, i = 0, written = 0;
+
+  while (i < length) {
+    // Gather source runs into the buffer, then write it out in one go
+    uint32_t fill = 0;
+    while (i < length && fill < per_batch) {
+      uint32_t run = 1;
+      while (i + run < length && fill + run < per_batch && chain[i + run] == chain[i] + run) run++;
+      if (!read_data(cursor, cluster_address(bpb, chain[i]), run * csize, buf + fill * csize))
+        return false;
+      fill += run;
+      i += run;
+    }
+    if (!write_data(cursor, cluster_address(bpb, dest + written), fill * csize, buf))
+      return false;
+    written += fill;
+  }
+  return true;
+}
+
+static bool write_move_log(const char *path, MoveBatch *batch) {
+  size_t size = 0, at = 0;
+  int i;
+  for (i = 0; i < batch->count; i++) {
+    MoveRecord *rec = &batch->moves[i].rec;
+    size += sizeof(*rec) + rec->length * sizeof(uint16_t) + rec->links * sizeof(uint32_t);
+  }
+  char *log = malloc(size);
+  for (i = 0; i < batch->count; i++) {
+    MoveRecord *rec = &batch->moves[i].rec;
+    memcpy(log + at, rec, sizeof(*rec));
+    at += sizeof(*rec);
+    memcpy(log + at, batch->moves[i].old, rec->length * sizeof(uint16_t));
+    at += rec->length * sizeof(uint16_t);
+    memcpy(log + at, batch->moves[i].links, rec->links * sizeof(uint32_t));
+    at += rec->links * sizeof(uint32_t);
+  }
+  bool ok = write_sidecar(path, log, size);
+  free(log);
+  return ok;
+}
+
+// Puts the in-memory FAT and layouts back the way they were before the
+// batch, for when it failed before touching the image
+static void forget_moves(MoveBatch *batch) {
+  uint16_t *fat = load_fat(batch->cursor);
+  uint32_t j;
+  int i;
+  for (i = batch->count - 1; i >= 0; i--) {
+    PendingMove *move = &batch->moves[i];
+    for (j = 0; j < move->rec.length; j++) fat[move->rec.new_start + j] = 0;
+    for (j = 0; j < move->rec.length; j++)
+      fat[move->old[j]] = (j + 1 < move->rec.length) ? move->old[j + 1] : 0xFFFF;
+    move->layout->file->entry.starting_cluster = move->rec.old_start;
+    move->layout->start = move->rec.old_start;
+    move->layout->extents = count_extents(move->old, move->rec.length);
+  }
+}
+
+// Switches every pending move over on the image: copies are synced, the
+// log is made durable, then the FAT and entries are updated and synced
+static bool commit_moves(MoveBatch *batch) {
+  Cursor *cursor = batch->cursor;
+  int i;
+  if (!batch->count || batch->failed) return !batch->failed;
+
+  char *path = sidecar_path(cursor->image_path, MOVE_LOG_SUFFIX);
+  bool logged = sync_image(cursor) && write_move_log(path, batch);
+  bool ok = logged;
+  for (i = 0; i < batch->count && ok; i++)
+    ok = apply_move(cursor, &batch->moves[i].rec, batch->moves[i].old, batch->moves[i].links);
+  ok = ok && sync_image(cursor);
+  if (ok) {
+    unlink(path);
+    sync_parent(path);
+  } else {
+    // Without a log the image was never touched; with one, replay at the
+    // next start settles it
+    if (!logged) forget_moves(batch);
+    disp_error(CODE_9, path, 0);
+    batch->failed = true;
+  }
+
+  for (i = 0; i < batch->count; i++) {
+    free(batch->moves[i].old);
+    free(batch->moves[i].links);
+  }
+  memset(batch->leaving, 0, cluster_count(cursor->bpb) + 2);
+  batch->count = 0;
+  free(path);
+  return ok;
+}
+
+// Copies the file to dest and adds the move to the batch. A directory is
+// committed on its own, with the batch before it committed first, so the
+// entries copied with it are the ones on the image.
+static bool queue_move(MoveBatch *batch, Layout *layout, uint16_t dest) {
+  Cursor *cursor = batch->cursor;
+  FileRef *file = layout->file;
+  uint16_t *fat = load_fat(cursor);
+  bool directory = file->entry.attributes & DIR_ATTR_DIRECTORY;
+  uint32_t length, i;
+  uint16_t *chain = get_chain(cursor, &file->entry, &length);
+  uint32_t address = cluster_slot_address(cursor, file->dir_cluster, file->slot);
+  if (!chain || !address || batch->failed) {
+    free(chain);
+    return false;
+  }
+
+  // Commit first if this move would overlap one already pending
+  bool overlaps = batch->count == MAX_BATCH_MOVES || (directory && batch->count);
+  for (i = 0; i < length && !overlaps; i++) overlaps = batch->leaving[dest + i];
+  for (i = 0; i < (uint32_t)batch->count && !overlaps; i++) overlaps = batch->moves[i].rec.entry_address == address;
+  if (overlaps && !commit_moves(batch)) {
+    free(chain);
+    return false;
+  }
+
+  if (!copy_clusters(cursor, chain, length, dest, batch->buf)) {
+    disp_error(CODE_9, file->path, 0);
+    free(chain);
+    return false;
+  }
+
+  uint16_t old_start = file->entry.starting_cluster;
+  uint32_t link_count = 0;
+  uint32_t *links = directory ? find_links(cursor, old_start, dest, &link_count) : NULL;
+  PendingMove *move = &batch->moves[batch->count++];
+  MoveRecord rec = { MOVE_LOG_MAGIC, address, old_start, dest, length, link_count };
+  move->rec = rec;
+  move->old = chain;
+  move->links = links;
+  move->layout = layout;
+  for (i = 0; i < length; i++) {
+    fat[dest + i] = (i + 1 < length) ? dest + i + 1 : 0xFFFF;
+  }
+  for (i = 0; i < length; i++) {
+    fat[chain[i]] = 0;
+    batch->leaving[chain[i]] = 1;
+  }
+  file->entry.starting_cluster = dest;
+  layout->start = dest;
+  layout->extents = 1;
+
+  if (directory) {
+    if (!commit_moves(batch)) return false;
+    moved_dir(batch, old_start, dest);
+  }
+  return true;
+}
+
+/********** Planning ***********/
+
+// Smallest free run of at least need clusters, or 0
+static uint16_t best_fit(uint16_t *fat, uint32_t last, uint32_t need) {
+  uint32_t c, best = 0, best_length = 0xFFFFFFFF;
+  for (c = 2; c < last; c++) {
+    if (fat[c] != 0) continue;
+    uint32_t start = c;
+    while (c < last && fat[c] == 0) c++;
+    if (c - start >= need && c - start < best_length) {
+      best = start;
+      best_length = c - start;
+    }
+  }
+  return best;
+}
+
+// Lowest free run of at least need clusters that ends before limit, or 0
+static uint16_t first_fit_below(uint16_t *fat, uint32_t limit, uint32_t need) {
+  uint32_t c;
+  for (c = 2; c + need <= limit; c++) {
+    if (fat[c] != 0) continue;
+    uint32_t start = c;
+    while (c < limit && fat[c] == 0 && c - start < need) c++;
+    if (c - start >= need) return start;
+  }
+  return 0;
+}
+
+static int compare_start(const void *a, const void *b) {
+  return (int)((const Layout *)a)->start - (int)((const Layout *)b)->start;
+}
+
+static void fragmentation(Layout *layouts, int count, int *fragmented, int *extents) {
+  int i;
+  *fragmented = *extents = 0;
+  for (i = 0; i < count; i++) {
+    *extents += layouts[i].extents;
+    if (layouts[i].extents > 1) (*fragmented)++;
+  }
+}
+
+// Adds a layout for each file in list with clusters to move
+static void add_layouts(Cursor *cursor, FileList *list, Layout *layouts, int *count, bool dry_run) {
+  int i;
+  for (i = 0; i < list->count; i++) {
+    FileRef *file = &list->files[i];
+    uint32_t length;
+    uint16_t *chain = get_chain(cursor, &file->entry, &length);
+    if (!chain) {
+      // Empty files have nothing to move; broken chains are left alone
+      if (file->entry.attributes & DIR_ATTR_DIRECTORY) printf("defrag: skipping %s (broken chain)\n", file->path);
+      else if (file->entry.size) printf("defrag: skipping %s (chain does not match size)\n", file->path);
+      continue;
+    }
+    if (length) {
+      Layout *layout = &layouts[(*count)++];
+      layout->file = file;
+      layout->start = chain[0];
+      layout->clusters = length;
+      layout->extents = count_extents(chain, length);
+      if (dry_run && layout->extents > 1) printf("%5d %s\n", layout->extents, file->path);
+    }
+    free(chain);
+  }
+}
+
+// defrag [-n]: rewrites every file and subdirectory on the volume into a
+// single run and compacts the data area. -n only reports the fragmentation
+// of each.
+void fs_defrag(Cursor *cursor, Word *args) {
+  bool dry_run = args && strcmp(args->token, "-n") == 0;
+  FileList files = { 0 }, dirs = { 0 };
+  walk_tree(cursor, &files, &dirs);
+
+  uint16_t *fat = load_fat(cursor);
+  uint32_t last = cluster_count(cursor->bpb) + 2;
+  Layout *layouts = calloc(files.count + dirs.count + 1, sizeof(Layout));
+  int count = 0, i;
+  add_layouts(cursor, &files, layouts, &count, dry_run);
+  add_layouts(cursor, &dirs, layouts, &count, dry_run);
+
+  int fragmented, extents;
+  fragmentation(layouts, count, &fragmented, &extents);
+  printf("%d files and directories, %d fragmented, %d extents\n", count, fragmented, extents);
+
+  if (!dry_run) {
+    MoveBatch *batch = calloc(1, sizeof(MoveBatch));
+    batch->cursor = cursor;
+    batch->buf = malloc(COPY_BATCH);
+    batch->leaving = calloc(last, 1);
+    batch->files = &files;
+    batch->dirs = &dirs;
+    int moved = 0;
+    uint32_t moved_clusters = 0;
+
+    // Compacting can open up a run that a file still fragmented now fits
+    // in, so keep going until a round moves nothing. Slides only ever go
+    // down and each file is gathered once, so this ends.
+    int round;
+    do {
+      round = 0;
+
+      // Gather each fragmented file into one run
+      for (i = 0; i < count; i++) {
+        if (layouts[i].extents < 2) continue;
+        uint16_t dest = best_fit(fat, last, layouts[i].clusters);
+        if (dest && queue_move(batch, &layouts[i], dest)) {
+          round++;
+          moved_clusters += layouts[i].clusters;
+        }
+      }
+
+      // Slide files down, lowest first, into holes ahead of them
+      qsort(layouts, count, sizeof(Layout), compare_start);
+      for (i = 0; i < count; i++) {
+        if (layouts[i].extents > 1) continue;
+        uint16_t dest = first_fit_below(fat, layouts[i].start, layouts[i].clusters);
+        if (dest && queue_move(batch, &layouts[i], dest)) {
+          round++;
+          moved_clusters += layouts[i].clusters;
+        }
+      }
+      moved += round;
+    } while (round && !batch->failed);
+    commit_moves(batch);
+    free(batch->buf);
+    free(batch->leaving);
+    free(batch);
+
+    // The shell's cached listing may name clusters that moved
+    if (moved) cursor->current->children = NULL;
+
+    fragmentation(layouts, count, &fragmented, &extents);
+    printf("moved %d files and directories (%u clusters); now %d fragmented, %d extents\n", moved, moved_clusters,
+        fragmented, extents);
+  }
+
+  free(layouts);
+  free_file_list(&files);
+  free_file_list(&dirs);
+}
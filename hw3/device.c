@@ -0,0 +1,89 @@
+#include "device.h"
+#include <fcntl.h>
+
+// A plain image file, accessed with positioned I/O so concurrent readers
+// never share an offset
+
+typedef struct {
+  Device base;
+  int fd;
+} FileDevice;
+
+bool fd_read(int fd, uint64_t offset, uint32_t length, void *buf) {
+  uint32_t done = 0;
+  while (done < length) {
+    ssize_t n = pread(fd, (char *)buf + done, length - done, offset + done);
+    if (n < 0) return false;
+    if (n == 0) break;
+    done += n;
+  }
+  if (done < length) memset((char *)buf + done, 0, length - done);
+  return true;
+}
+
+bool fd_write(int fd, uint64_t offset, uint32_t length, const void *buf) {
+  uint32_t done = 0;
+  while (done < length) {
+    ssize_t n = pwrite(fd, (const char *)buf + done, length - done, offset + done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool file_read(Device *dev, uint64_t offset, uint32_t length, void *buf) {
+  return fd_read(((FileDevice *)dev)->fd, offset, length, buf);
+}
+
+static bool file_write(Device *dev, uint64_t offset, uint32_t length, const void *buf) {
+  return fd_write(((FileDevice *)dev)->fd, offset, length, buf);
+}
+
+static bool file_writev(Device *dev, uint64_t offset, const struct iovec *iov, int count) {
+  FileDevice *file = (FileDevice *)dev;
+  ssize_t want = 0;
+  int i;
+  for (i = 0; i < count; i++) want += iov[i].iov_len;
+  if (pwritev(file->fd, iov, count, offset) == want) return true;
+
+  // Short gathered write: fall back to one piece at a time
+  for (i = 0; i < count; i++) {
+    if (!file_write(dev, offset, iov[i].iov_len, iov[i].iov_base)) return false;
+    offset += iov[i].iov_len;
+  }
+  return true;
+}
+
+static bool file_sync(Device *dev) {
+  return fsync(((FileDevice *)dev)->fd) == 0;
+}
+
+static void file_close(Device *dev) {
+  close(((FileDevice *)dev)->fd);
+  free(dev);
+}
+
+Device *image_open(const char *path) {
+  if (is_bgzf(path)) return bgzf_device_open(path);
+  return file_device_open(path);
+}
+
+Device *file_device_open(const char *path) {
+  bool writable = true;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    fd = open(path, O_RDONLY);
+    writable = false;
+  }
+  if (fd < 0) return NULL;
+
+  FileDevice *file = calloc(1, sizeof(FileDevice));
+  file->base.read = file_read;
+  file->base.write = file_write;
+  file->base.writev = file_writev;
+  file->base.sync = file_sync;
+  file->base.close = file_close;
+  file->base.writable = writable;
+  file->fd = fd;
+  return &file->base;
+}
@@ -0,0 +1,65 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include "fat.h"
+#include <sys/uio.h>
+
+// Block devices the image is read from and written to. read_bytes and
+// write_bytes go through one of these, so the rest of the program doesn't
+// care whether the image is a plain file or a view over one.
+//
+// Devices return false on failure without reporting it; read_bytes and
+// write_bytes do that.
+
+struct device_t {
+  bool (*read)(Device *dev, uint64_t offset, uint32_t length, void *buf);
+  bool (*write)(Device *dev, uint64_t offset, uint32_t length, const void *buf);
+  bool (*writev)(Device *dev, uint64_t offset, const struct iovec *iov, int count);
+  bool (*sync)(Device *dev);
+  void (*close)(Device *dev);
+  bool writable;
+};
+
+// Opens the image at path with whichever device understands its format
+Device *image_open(const char *path);
+
+// Opens path for update, or read-only when that is all we may do
+Device *file_device_open(const char *path);
+
+// Read-only access to a BGZF-compressed image, without decompressing it
+// to disk first
+bool is_bgzf(const char *path);
+Device *bgzf_device_open(const char *path);
+
+// Positioned I/O on a descriptor that retries short transfers. Reads past
+// the end of the file yield zeroes.
+bool fd_read(int fd, uint64_t offset, uint32_t length, void *buf);
+bool fd_write(int fd, uint64_t offset, uint32_t length, const void *buf);
+
+/********** Overlays ***********/
+
+// A copy-on-write view of a base image. The base is only ever read; every
+// write goes to a sparse delta file that holds a header, a bitmap with one
+// bit per base sector, and then each written sector at its own offset.
+// Creating a delta is a couple of small writes and a truncate, so a
+// writable view of any image is available immediately.
+
+#define OVERLAY_MAGIC 0x594C564F
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sector_size;
+  uint64_t base_size;       // bytes; a delta only fits the base it was made for
+  uint64_t data_offset;     // where sector 0's data would live
+} OverlayHeader;
+
+// Opens the delta at delta_path over the image at base_path, creating it
+// if it doesn't exist yet
+Device *overlay_open(const char *base_path, const char *delta_path);
+
+bool is_overlay(Device *dev);
+
+// Copies every sector in the delta into the base and empties the delta
+bool overlay_commit(Device *dev);
+
+#endif
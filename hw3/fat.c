@@ -1,4 +1,8 @@
 #include "fat.h"
+#include "cache.h"
+#include "device.h"
+#include "index.h"
+#include <fcntl.h>
 
 // Displays an error message and kills program if fatal
 void disp_error(Error code, void *arg, int fatal) {
@@ -6,18 +10,58 @@ void disp_error(Error code, void *arg, int fatal) {
 	if (fatal) exit(0);
 }
 
-bool read_bytes(FILE *file, unsigned int offset, unsigned int length, void *buf) {
-	if (fseek(file, offset, SEEK_SET != 0)) {
-		disp_error(CODE_2, NULL, 0);
+bool read_bytes(Device *dev, unsigned int offset, unsigned int length, void *buf) {
+	if (!dev->read(dev, offset, length, buf)) {
+		disp_error(CODE_3, NULL, 0);
 		return false;
 	}
-	if (fread(buf, 1, length, file) != length && ferror(file)) {
-		disp_error(CODE_3, NULL, 0);
+	return true;
+}
+
+bool write_bytes(Device *dev, unsigned int offset, unsigned int length, const void *buf) {
+	if (!dev->write(dev, offset, length, buf)) {
+		disp_error(CODE_9, NULL, 0);
+		return false;
 	}
 	return true;
 }
 
 
+bool read_meta(Cursor *cursor, uint32_t offset, uint32_t length, void *buf) {
+	if (!cursor->cache) return read_bytes(cursor->device, offset, length, buf);
+	return cache_read(cursor->cache, offset, length, buf);
+}
+
+bool write_meta(Cursor *cursor, uint32_t offset, uint32_t length, const void *buf) {
+	drop_index(cursor);
+	if (!cursor->cache) return write_bytes(cursor->device, offset, length, buf);
+	return cache_write(cursor->cache, offset, length, buf);
+}
+
+bool read_data(Cursor *cursor, uint32_t offset, uint32_t length, void *buf) {
+	if (!read_bytes(cursor->device, offset, length, buf)) return false;
+	if (cursor->cache) cache_patch(cursor->cache, offset, length, buf);
+	return true;
+}
+
+bool write_data(Cursor *cursor, uint32_t offset, uint32_t length, const void *buf) {
+	drop_index(cursor);
+	if (!write_bytes(cursor->device, offset, length, buf)) return false;
+	// After the write, so a cache miss being read meanwhile sees it went stale
+	if (cursor->cache) cache_update(cursor->cache, offset, length, buf);
+	return true;
+}
+
+bool sync_image(Cursor *cursor) {
+	if (cursor->cache && !cache_flush(cursor->cache)) return false;
+	return cursor->device->sync(cursor->device);
+}
+
+void close_image(Cursor *cursor) {
+	if (cursor->index && cursor->index->rebuild) save_index(cursor);
+	sync_image(cursor);
+	cursor->device->close(cursor->device);
+}
 
 /********** BPB functions ***********/
 
@@ -42,22 +86,146 @@ uint32_t data_address(BPB *bpb) {
 }
 
 uint32_t data_sector_count(BPB *bpb) {
-    return bpb->total_sectors_32 - data_address(bpb) / bpb->bytes_per_sector;
+    uint32_t total = bpb->total_sectors_16 ? bpb->total_sectors_16 : bpb->total_sectors_32;
+    return total - data_address(bpb) / bpb->bytes_per_sector;
+}
+
+uint32_t cluster_size(BPB *bpb) {
+  return bpb->bytes_per_sector * bpb->sectors_per_cluster;
 }
 
-uint16_t get_next_cluster(FILE *f, BPB *bpb, uint16_t current_cluster) {
+// Number of data clusters, capped by what the FAT can address
+uint32_t cluster_count(BPB *bpb) {
+  uint32_t count = data_sector_count(bpb) / bpb->sectors_per_cluster;
+  uint32_t entries = fat_size(bpb) * bpb->bytes_per_sector / 2;
+  if (count + 2 > entries) count = entries - 2;
+  return count;
+}
+
+uint32_t cluster_address(BPB *bpb, uint16_t cluster) {
+  return data_address(bpb) + (cluster - 2) * cluster_size(bpb);
+}
+
+uint16_t get_next_cluster(Device *f, BPB *bpb, uint16_t current_cluster) {
 	uint16_t retval;
 	read_bytes(f, fat_address(bpb) + current_cluster*2, sizeof(retval), &retval);
 	return retval;
 }
 
-void init_boot_sector(BPB *boot_sector, FILE *file) {
-	read_bytes(file, BOOT_SECTOR_OFFSET, sizeof(*boot_sector), boot_sector);
-	if(boot_sector->bytes_per_sector != BYTES_PER_SECTOR || boot_sector->table_count != NUM_FATS)
+/********** FAT functions ***********/
+
+uint16_t *load_fat(Cursor *cursor) {
+  if (cursor->fat) return cursor->fat;
+  BPB *bpb = cursor->bpb;
+  uint32_t length = fat_size(bpb) * bpb->bytes_per_sector;
+  cursor->fat = malloc(length);
+  if (!index_fat(cursor, cursor->fat, length))
+    read_data(cursor, fat_address(bpb), length, cursor->fat);
+  return cursor->fat;
+}
+
+// With a cache, only the first copy is written; the cache mirrors it
+bool store_fat_sectors(Cursor *cursor, uint32_t first, uint32_t count) {
+  BPB *bpb = cursor->bpb;
+  uint32_t length = fat_size(bpb) * bpb->bytes_per_sector;
+  uint32_t offset = first * bpb->bytes_per_sector;
+  int i;
+  if (cursor->cache)
+    return write_meta(cursor, fat_address(bpb) + offset, count * bpb->bytes_per_sector, (char *)cursor->fat + offset);
+  for (i = 0; i < bpb->table_count; i++) {
+    if (!write_bytes(cursor->device, fat_address(bpb) + i * length + offset,
+        count * bpb->bytes_per_sector, (char *)cursor->fat + offset))
+      return false;
+  }
+  return true;
+}
+
+bool store_fat(Cursor *cursor) {
+  return store_fat_sectors(cursor, 0, fat_size(cursor->bpb));
+}
+
+uint16_t next_cluster(Cursor *cursor, uint16_t cluster) {
+  return load_fat(cursor)[cluster];
+}
+
+/********** Directory functions ***********/
+
+uint32_t cluster_slot_address(Cursor *cursor, uint16_t cluster, int i) {
+  BPB *boot = cursor->bpb;
+  if (cluster == 0) {
+    if (i >= boot->root_entry_count) return 0;
+    return root_address(boot) + i * 32;
+  }
+
+  uint32_t per_cluster = cluster_size(boot) / 32;
+  int hops = i / per_cluster;
+  while (hops-- > 0) {
+    cluster = next_cluster(cursor, cluster);
+    if (cluster < 2 || cluster >= 0xFFF8) return 0;
+  }
+  return cluster_address(boot, cluster) + (i % per_cluster) * 32;
+}
+
+uint32_t dir_slot_address(Cursor *cursor, EntryNode *dir, int i) {
+  uint16_t cluster = dir->isRoot ? 0 : dir->entry->starting_cluster;
+  return cluster_slot_address(cursor, cluster, i);
+}
+
+uint16_t current_cluster(Cursor *cursor) {
+  EntryNode *current = cursor->current;
+  return current->isRoot ? 0 : current->entry->starting_cluster;
+}
+
+// Finds a free cluster in the in-memory FAT, or 0 if the volume is full
+static uint16_t find_free_cluster(Cursor *cursor) {
+  uint16_t *fat = load_fat(cursor);
+  uint32_t c, last = cluster_count(cursor->bpb) + 2;
+  for (c = 2; c < last; c++) {
+    if (fat[c] == 0) return c;
+  }
+  return 0;
+}
+
+uint32_t find_free_slot(Cursor *cursor, EntryNode *dir) {
+  BPB *boot = cursor->bpb;
+  uint32_t address;
+  unsigned char first;
+  int i = 0;
+  while ((address = dir_slot_address(cursor, dir, i++)) != 0) {
+    read_meta(cursor, address, 1, &first);
+    if (first == 0 || first == UNUSED_FLAG) return address;
+  }
+  if (dir->isRoot || dir->entry->starting_cluster == 0) return 0;
+
+  // Subdirectory is full: append a zeroed cluster to its chain
+  uint16_t *fat = load_fat(cursor);
+  uint16_t last = dir->entry->starting_cluster;
+  while (fat[last] >= 2 && fat[last] < 0xFFF8) last = fat[last];
+  uint16_t fresh = find_free_cluster(cursor);
+  if (!fresh) {
+    disp_error(CODE_8, NULL, 0);
+    return 0;
+  }
+  char *zero = calloc(1, cluster_size(boot));
+  write_meta(cursor, cluster_address(boot, fresh), cluster_size(boot), zero);
+  free(zero);
+  fat[fresh] = 0xFFFF;
+  fat[last] = fresh;
+  if (!store_fat(cursor)) return 0;
+  return cluster_address(boot, fresh);
+}
+
+bool read_boot_sector(BPB *boot_sector, Device *file) {
+	return read_bytes(file, BOOT_SECTOR_OFFSET, sizeof(*boot_sector), boot_sector) &&
+		boot_sector->bytes_per_sector == BYTES_PER_SECTOR && boot_sector->table_count == NUM_FATS;
+}
+
+void init_boot_sector(BPB *boot_sector, Device *file) {
+	if (!read_boot_sector(boot_sector, file))
         disp_error(CODE_4, NULL, 1);
 }
 
-void print_cluster(FILE *f, BPB *bpb, Fat16Entry *entry) {
+void print_cluster(Device *f, BPB *bpb, Fat16Entry *entry) {
     const uint32_t cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
     uint16_t c;
 
@@ -68,6 +236,17 @@ void print_cluster(FILE *f, BPB *bpb, Fat16Entry *entry) {
     }
 }
 
+void print_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+    else if (c < 0x20 || c >= 0x7F) fprintf(out, "\\u%04x", c);
+    else fputc(c, out);
+  }
+  fputc('"', out);
+}
+
 void print_node_name(EntryNode *node) {
 	if (node->isDirectory) printf("D ");
 	else printf("F ");
@@ -153,17 +332,16 @@ uint32_t get_offset(FILE *fat_file, BPB *boot, EntryNode *current) {
 }
 
 EntryNode *fs_ls(Cursor *cursor, Word *args) {
-  FILE *fat_file = cursor->fat_file;
   BPB *boot = cursor->bpb;
   EntryNode *current = cursor->current;
 
-  uint32_t offset = get_offset(fat_file, boot, current);
-	int i=0;
-	EntryNode *head;
+	uint32_t offset, length;
+	EntryNode *head=NULL;
 	EntryNode *previous=NULL;
-	while (true) {
+	char *data = read_dir_data(cursor, current_cluster(cursor), &length);
+	for (offset = 0; offset + sizeof(Fat16Entry) <= length; offset += sizeof(Fat16Entry)) {
 		Fat16Entry *fatEntry = malloc(sizeof(Fat16Entry));
-		read_bytes(fat_file, offset + (i++)*32, sizeof(Fat16Entry), fatEntry);
+		memcpy(fatEntry, data + offset, sizeof(Fat16Entry));
 
     // Make sure it's a valid entry. Discard if not
 		if (fatEntry->name[0] == 0) {
@@ -177,7 +355,7 @@ EntryNode *fs_ls(Cursor *cursor, Word *args) {
 		}	
 
     // Wrap the FATEntry in an EntryNode
-		EntryNode *node = malloc(sizeof(EntryNode));
+		EntryNode *node = calloc(1, sizeof(EntryNode));
 		node->entry=fatEntry;
 		if (fatEntry->attributes & DIR_ATTR_DIRECTORY) 
 			node->isDirectory = 1;
@@ -191,6 +369,7 @@ EntryNode *fs_ls(Cursor *cursor, Word *args) {
 
 		previous = node;		
 	}
+	free(data);
 
   // If there are arguments, recurse down without mutating 
   // the state of the cursor
@@ -235,12 +414,12 @@ void fs_cd(Cursor *cursor, Word *path) {
   }
   
   else {
-    print_word(cursor->path);
+    // The input's words are freed after the command, so keep a copy
     Word *head = cursor->path;
     while (head->next) {head = head->next;}
-    head->next = path;
+    head->next = (Word *)malloc(sizeof(Word));
+    head->next->token = strdup(path->token);
     head->next->next = NULL;
-    print_word(cursor->path);
   }
 
   if (path->next) fs_cd(cursor, path->next);
@@ -255,8 +434,211 @@ void print_word(Word *word) {
   printf("]\n");
 }
 
-void fs_cpin(Cursor *cursor, Word *args) {
-  
+/********** Tree walking ***********/
+
+void entry_file_name(Fat16Entry *entry, char *out) {
+  int i, n = 0;
+  for (i = 0; i < 8 && entry->name[i] != SPACE && entry->name[i] != '\0'; i++)
+    out[n++] = entry->name[i];
+  if (entry->ext[0] != SPACE && entry->ext[0] != '\0') {
+    out[n++] = '.';
+    for (i = 0; i < 3 && entry->ext[i] != SPACE && entry->ext[i] != '\0'; i++)
+      out[n++] = entry->ext[i];
+  }
+  out[n] = '\0';
+
+  // A name is always one path component, whatever bytes the entry holds
+  for (i = 0; i < n; i++) if (out[i] == '/') out[i] = '_';
+}
+
+static void add_file(FileList *list, char *path, Fat16Entry *entry, uint16_t dir_cluster, int slot) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->files = realloc(list->files, sizeof(FileRef) * list->capacity);
+  }
+  list->files[list->count].path = path;
+  list->files[list->count].entry = *entry;
+  list->files[list->count].dir_cluster = dir_cluster;
+  list->files[list->count].slot = slot;
+  list->count++;
+}
+
+char *join_path(const char *prefix, const char *name) {
+  char *path = malloc(strlen(prefix) + strlen(name) + 2);
+  if (*prefix) sprintf(path, "%s/%s", prefix, name);
+  else strcpy(path, name);
+  return path;
+}
+
+char *sidecar_path(const char *path, const char *suffix) {
+  char *out = malloc(strlen(path) + strlen(suffix) + 1);
+  sprintf(out, "%s%s", path, suffix);
+  return out;
+}
+
+bool sync_parent(const char *path) {
+  char *dir = malloc(strlen(path) + 2);
+  char *slash = strrchr(strcpy(dir, path), '/');
+  if (!slash) strcpy(dir, ".");
+  else if (slash == dir) slash[1] = '\0';
+  else *slash = '\0';
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  bool ok = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0) close(fd);
+  free(dir);
+  return ok;
+}
+
+bool write_sidecar(const char *path, const void *buf, size_t length) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  size_t done = 0;
+  bool ok = fd >= 0;
+  while (ok && done < length) {
+    ssize_t n = write(fd, (const char *)buf + done, length - done);
+    ok = n > 0;
+    if (ok) done += n;
+  }
+  ok = ok && fsync(fd) == 0;
+  if (fd >= 0) close(fd);
+  return ok && sync_parent(path);
+}
+
+char *read_dir_data(Cursor *cursor, uint16_t cluster, uint32_t *length) {
+  BPB *bpb = cursor->bpb;
+  char *data;
+  if (index_dir_data(cursor, cluster, &data, length)) return data;
+  if (cluster == 0) {
+    *length = bpb->root_entry_count * 32;
+    data = malloc(*length);
+    read_meta(cursor, root_address(bpb), *length, data);
+    return data;
+  }
+
+  uint32_t csize = cluster_size(bpb);
+  uint32_t budget = cluster_count(bpb);
+  data = NULL;
+  *length = 0;
+  while (cluster >= 2 && cluster < 0xFFF8 && budget-- > 0) {
+    data = realloc(data, *length + csize);
+    read_meta(cursor, cluster_address(bpb, cluster), csize, data + *length);
+    *length += csize;
+    cluster = next_cluster(cursor, cluster);
+  }
+  return data;
+}
+
+static void walk_dir(Cursor *cursor, uint16_t cluster, const char *prefix, bool recursive,
+    FileList *list, FileList *dirs, int depth) {
+  uint32_t length, i;
+  char *data = read_dir_data(cursor, cluster, &length);
+  for (i = 0; i + 32 <= length; i += 32) {
+    Fat16Entry entry;
+    memcpy(&entry, data + i, sizeof(entry));
+    if (entry.name[0] == 0) break;
+    if (entry.name[0] == UNUSED_FLAG || entry.name[0] == '.' ||
+        (entry.attributes & DIR_ATTR_LFN) == DIR_ATTR_LFN ||
+        entry.attributes & DIR_ATTR_VOLUMEID)
+      continue;
+
+    char name[13];
+    entry_file_name(&entry, name);
+    char *path = join_path(prefix, name);
+    if (!(entry.attributes & DIR_ATTR_DIRECTORY)) {
+      add_file(list, path, &entry, cluster, i / 32);
+      continue;
+    }
+    if (recursive && depth < MAX_WALK_DEPTH && entry.starting_cluster >= 2) {
+      walk_dir(cursor, entry.starting_cluster, path, recursive, list, dirs, depth + 1);
+      if (dirs) {
+        add_file(dirs, path, &entry, cluster, i / 32);
+        continue;
+      }
+    }
+    free(path);
+  }
+  free(data);
+}
+
+void walk_files(Cursor *cursor, uint16_t cluster, const char *prefix, bool recursive, FileList *list) {
+  load_fat(cursor);
+  walk_dir(cursor, cluster, prefix, recursive, list, NULL, 0);
+}
+
+void walk_tree(Cursor *cursor, FileList *files, FileList *dirs) {
+  load_fat(cursor);
+  walk_dir(cursor, 0, "", true, files, dirs, 0);
+}
+
+void free_file_list(FileList *list) {
+  int i;
+  for (i = 0; i < list->count; i++) free(list->files[i].path);
+  free(list->files);
+  memset(list, 0, sizeof(FileList));
+}
+
+#define STREAM_CHUNK (1024 * 1024)
+
+bool stream_file(Cursor *cursor, Fat16Entry *entry, ChunkSink sink, void *ctx) {
+  BPB *bpb = cursor->bpb;
+  uint32_t csize = cluster_size(bpb);
+  uint32_t per_chunk = STREAM_CHUNK / csize ? STREAM_CHUNK / csize : 1;
+  uint32_t remaining = entry->size;
+  uint32_t budget = cluster_count(bpb);
+  uint16_t c = entry->starting_cluster;
+  char *buf = malloc(per_chunk * csize);
+  bool ok = true;
+
+  while (remaining > 0 && ok) {
+    if (c < 2 || c >= 0xFFF8 || budget == 0) {
+      ok = false;
+      break;
+    }
+
+    // Extend the read over clusters that follow each other on disk
+    uint16_t start = c;
+    uint32_t run = 1;
+    c = next_cluster(cursor, c);
+    while (run < per_chunk && run * csize < remaining && c == start + run && budget > run) {
+      c = next_cluster(cursor, c);
+      run++;
+    }
+    budget -= run;
+
+    uint32_t length = run * csize;
+    if (length > remaining) length = remaining;
+    if (!read_data(cursor, cluster_address(bpb, start), length, buf)) {
+      ok = false;
+      break;
+    }
+    ok = sink(ctx, buf, length);
+    remaining -= length;
+  }
+  free(buf);
+  return ok;
+}
+
+// sync: writes out every cached change to the image
+void fs_sync(Cursor *cursor, Word *args) {
+  if (!sync_image(cursor)) disp_error(CODE_9, NULL, 0);
+}
+
+// commit: merges an overlay's delta into its base image
+void fs_commit(Cursor *cursor, Word *args) {
+  if (!is_overlay(cursor->device)) {
+    disp_error(CODE_10, NULL, 0);
+    return;
+  }
+  if (!sync_image(cursor) || !overlay_commit(cursor->device)) disp_error(CODE_9, NULL, 0);
+}
+
+// index: writes <image>.idx so later runs can skip reading metadata
+void fs_index(Cursor *cursor, Word *args) {
+  if (is_overlay(cursor->device)) {
+    disp_error(CODE_11, NULL, 0);
+    return;
+  }
+  if (!save_index(cursor)) disp_error(CODE_9, NULL, 0);
 }
 
 void fs_cpout(Cursor *cursor, Word *args) {
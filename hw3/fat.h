@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 
 #define BOOT_SECTOR_LENGTH 512
@@ -30,6 +31,7 @@ typedef struct input_t{
   Word *words;
 
   char    *string;
+  char    *raw;     // untouched copy of string, for host paths
   char    *cmd;
   int     length;
 } Input;
@@ -52,10 +54,21 @@ typedef enum {
     CODE_4, // Invalid FAT information
     CODE_5, // Invalid input
     CODE_6, // Directory does not exist
+    CODE_7, // Host file could not be read
+    CODE_8, // Not enough free clusters
+    CODE_9, // Error writing file
+    CODE_10, // Image is not an overlay
+    CODE_11, // Not supported on an overlay
 } Error;
 
 typedef struct dir_list_t EntryNode;
 
+typedef struct cache_t Cache;
+
+typedef struct device_t Device;
+
+typedef struct meta_index_t MetaIndex;
+
 typedef struct {
   unsigned char     bootjmp[3];
   unsigned char     oem_name[8];
@@ -83,7 +96,7 @@ typedef struct {
     unsigned short modify_time;
     unsigned short modify_date;
     unsigned short starting_cluster;
-    unsigned long size;
+    uint32_t size;
 } __attribute((packed)) Fat16Entry;
 
 typedef struct dir_list_t {
@@ -99,19 +112,172 @@ typedef struct dir_list_t {
 } EntryNode;
 
 typedef struct {
-  FILE *fat_file;
+  Device *device;
+  char *image_path;     // sidecar files (journal, move log) are named after it
   BPB *bpb;
   EntryNode *current;
   Word *path;
+
+  // In-memory copy of the first FAT, loaded on demand by load_fat
+  uint16_t *fat;
+
+  // Write-back cache for metadata sectors; NULL means unbuffered
+  Cache *cache;
+
+  // Persisted metadata index, when the image has one
+  MetaIndex *index;
 } Cursor;
 
+// A file found by walk_files, with its path relative to where the walk began
+typedef struct {
+  char *path;
+  Fat16Entry entry;
+
+  // Where the entry lives: cluster_slot_address(cursor, dir_cluster, slot)
+  uint16_t dir_cluster;
+  int slot;
+} FileRef;
+
+typedef struct {
+  FileRef *files;
+  int count;
+  int capacity;
+} FileList;
+
+// Receives consecutive pieces of a file; returning false stops the stream
+typedef bool (*ChunkSink)(void *ctx, const char *buf, uint32_t length);
+
 /************ Helpers ***********/
 
 
 // Displays an error message and kills program if fatal
 void disp_error(Error code, void *arg, int fatal);
 
-bool read_bytes(FILE *file, unsigned int offset, unsigned int length, void *buf);
+bool read_bytes(Device *dev, unsigned int offset, unsigned int length, void *buf);
+
+bool write_bytes(Device *dev, unsigned int offset, unsigned int length, const void *buf);
+
+// FAT, directory and entry I/O goes through the cursor's sector cache
+bool read_meta(Cursor *cursor, uint32_t offset, uint32_t length, void *buf);
+bool write_meta(Cursor *cursor, uint32_t offset, uint32_t length, const void *buf);
+
+// File data bypasses the cache but stays coherent with it
+bool read_data(Cursor *cursor, uint32_t offset, uint32_t length, void *buf);
+bool write_data(Cursor *cursor, uint32_t offset, uint32_t length, const void *buf);
+
+// Flushes the cache and makes everything written so far durable
+bool sync_image(Cursor *cursor);
+
+// Syncs, refreshes the metadata index if it went stale, and closes the image
+void close_image(Cursor *cursor);
+
+uint32_t fat_size(BPB *bpb);
+
+uint32_t cluster_size(BPB *bpb);
+
+uint32_t cluster_count(BPB *bpb);
+
+uint32_t cluster_address(BPB *bpb, uint16_t cluster);
+
+// Loads the first FAT into cursor->fat (once) and returns it
+uint16_t *load_fat(Cursor *cursor);
+
+// Writes cursor->fat to every FAT copy on the image
+bool store_fat(Cursor *cursor);
+
+// Same, for count sectors of the FAT starting at sector first
+bool store_fat_sectors(Cursor *cursor, uint32_t first, uint32_t count);
+
+uint16_t next_cluster(Cursor *cursor, uint16_t cluster);
+
+// Image offset of the i-th entry slot of a directory, 0 once past its end
+uint32_t dir_slot_address(Cursor *cursor, EntryNode *dir, int i);
+
+// Same, for the directory starting at cluster (0 for the root)
+uint32_t cluster_slot_address(Cursor *cursor, uint16_t cluster, int i);
+
+// Starting cluster of the cursor's current directory, 0 for the root
+uint16_t current_cluster(Cursor *cursor);
+
+// Writes NAME.EXT (at most 12 characters) to out
+void entry_file_name(Fat16Entry *entry, char *out);
+
+// prefix/name, or just name when prefix is empty
+char *join_path(const char *prefix, const char *name);
+
+// path with suffix appended, naming a file kept next to it (the journal,
+// the move log, the index)
+char *sidecar_path(const char *path, const char *suffix);
+
+// fsyncs the directory holding path, so a file just created or renamed
+// there survives a crash
+bool sync_parent(const char *path);
+
+// Replaces the file at path with length bytes of buf and makes it durable:
+// the whole buffer is written, then the file and its directory are synced
+bool write_sidecar(const char *path, const void *buf, size_t length);
+
+// Reads every entry slot of the directory at cluster (0 for the root)
+char *read_dir_data(Cursor *cursor, uint16_t cluster, uint32_t *length);
+
+// Deeper than any valid FAT path; guards against looping directories
+#define MAX_WALK_DEPTH 128
+
+// Appends the files under the directory at cluster to list
+void walk_files(Cursor *cursor, uint16_t cluster, const char *prefix, bool recursive, FileList *list);
+
+// Walks the whole volume, appending files to files and subdirectories to dirs
+void walk_tree(Cursor *cursor, FileList *files, FileList *dirs);
+
+void free_file_list(FileList *list);
+
+// Feeds a file's data to sink, reading contiguous clusters in one go.
+// The FAT must already be loaded when called from several threads.
+bool stream_file(Cursor *cursor, Fat16Entry *entry, ChunkSink sink, void *ctx);
+
+// Image offset of a free entry slot in dir, growing subdirectories if needed
+uint32_t find_free_slot(Cursor *cursor, EntryNode *dir);
+
+void fs_cpin(Cursor *cursor, Word *args);
+
+void fs_hash(Cursor *cursor, Word *args);
+
+// Length of the hex digest hash_file writes, with its terminator
+#define HASH_HEX_LENGTH 65
+
+// CRC32C of a file's contents plus its SHA-256, or xxHash64 with use_xxh,
+// as lowercase hex
+bool hash_file(Cursor *cursor, Fat16Entry *entry, bool use_xxh, uint32_t *crc, char *digest);
+
+void fs_grep(Cursor *cursor, Word *args);
+
+void fs_scan_deleted(Cursor *cursor, Word *args);
+
+void fs_undelete(Cursor *cursor, Word *args);
+
+// Joins an image path onto a host directory so the result stays inside
+// it: backslashes, '?' and control bytes become '_', and so does any
+// component that is "." or ".."
+char *host_path(const char *dir, const char *path);
+
+// Creates every missing host directory leading up to path
+void make_parents(char *path);
+
+void fs_defrag(Cursor *cursor, Word *args);
+
+void fs_layout(Cursor *cursor, Word *args);
+
+void fs_sync(Cursor *cursor, Word *args);
+
+void fs_commit(Cursor *cursor, Word *args);
+
+void fs_index(Cursor *cursor, Word *args);
+
+// Runs fat --batch; argv starts at the operation. Returns the exit status.
+int run_batch(int argc, char **argv);
+
+// Finishes or rolls back a defrag move interrupted by a crash
+void replay_move_log(Cursor *cursor);
 
 EntryNode *fs_ls(Cursor *cursor, Word *args);
 
@@ -121,7 +287,13 @@ void print_node_name(EntryNode *node);
 
 void display_children(EntryNode *node);
 
-void init_boot_sector(BPB *boot_sector, FILE *file);
+// Prints s as a quoted, escaped JSON string
+void print_json_string(FILE *out, const char *s);
+
+// Reads the BPB; false if it isn't one this program understands
+bool read_boot_sector(BPB *boot_sector, Device *file);
+
+void init_boot_sector(BPB *boot_sector, Device *file);
 //BPB functions
 
 
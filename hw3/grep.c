@@ -0,0 +1,221 @@
+#include "fat.h"
+#include "pool.h"
+#include <regex.h>
+
+// Content search (grep). Every file under the current directory is
+// streamed through the matcher on the worker pool. Fixed strings use a
+// memchr prefilter on the first byte and keep the last few bytes of each
+// chunk so matches across cluster boundaries are still found. With -E,
+// lines are rebuilt across chunks and handed to regexec with explicit
+// lengths (REG_STARTEND), so NUL bytes in binary files don't end them.
+
+// Lines longer than this are searched in pieces that overlap by
+// REGEX_OVERLAP bytes; a match must fit in the overlap to be found whole
+// across a piece boundary
+#define MAX_LINE (64 * 1024)
+#define REGEX_OVERLAP 4096
+#define MAX_PATTERN 256
+
+typedef struct {
+  const char *needle;
+  uint32_t needle_length;
+  regex_t *regex;
+} Matcher;
+
+typedef struct {
+  Cursor *cursor;
+  FileRef *file;
+  Matcher *matcher;
+
+  uint32_t offset;      // file offset of the chunk being searched
+  char *carry;          // last bytes seen, or the pending line with -E
+  uint32_t carry_length;
+  uint32_t carry_offset;  // file offset of the pending line
+  bool carry_bol;         // the pending piece starts a line
+  uint32_t resume;        // file offset where the next -E match may start
+  bool line_hit;          // the current line has matched
+
+  uint32_t *hits;
+  int hit_count;
+  int hit_capacity;
+  bool ok;
+} GrepJob;
+
+static void add_hit(GrepJob *job, uint32_t offset) {
+  if (job->hit_count == job->hit_capacity) {
+    job->hit_capacity = job->hit_capacity ? job->hit_capacity * 2 : 16;
+    job->hits = realloc(job->hits, sizeof(uint32_t) * job->hit_capacity);
+  }
+  job->hits[job->hit_count++] = offset;
+}
+
+// Reports every match starting in buf[0, limit); base is buf's file offset
+static void find_fixed(GrepJob *job, const char *buf, uint32_t length, uint32_t limit, uint32_t base) {
+  const char *needle = job->matcher->needle;
+  uint32_t m = job->matcher->needle_length;
+  const char *p = buf;
+  if (length < m) return;
+  const char *last = buf + (limit < length - m + 1 ? limit : length - m + 1);
+  while (p < last && (p = memchr(p, needle[0], last - p)) != NULL) {
+    if (memcmp(p + 1, needle + 1, m - 1) == 0) add_hit(job, base + (p - buf));
+    p++;
+  }
+}
+
+static bool grep_fixed(void *ctx, const char *buf, uint32_t length) {
+  GrepJob *job = ctx;
+  uint32_t keep = job->matcher->needle_length - 1;
+  uint32_t head = length < keep ? length : keep;
+
+  // Matches that start in the carried tail and end in this chunk
+  char window[2 * keep + 1];
+  memcpy(window, job->carry, job->carry_length);
+  memcpy(window + job->carry_length, buf, head);
+  uint32_t window_length = job->carry_length + head;
+  find_fixed(job, window, window_length, job->carry_length, job->offset - job->carry_length);
+  find_fixed(job, buf, length, length, job->offset);
+
+  // Carry the last needle_length - 1 bytes seen into the next chunk
+  if (length >= keep) {
+    memcpy(job->carry, buf + length - keep, keep);
+    job->carry_length = keep;
+  } else {
+    uint32_t n = window_length < keep ? window_length : keep;
+    memmove(job->carry, window + window_length - n, n);
+    job->carry_length = n;
+  }
+  job->offset += length;
+  return true;
+}
+
+// Reports every match in the pending piece. A piece cut off mid-line
+// only reports matches starting before its last REGEX_OVERLAP bytes;
+// those bytes start the next piece. Empty matches are only reported
+// when nothing else on the line has matched, so ^ and ^$ still find lines.
+static void search_piece(GrepJob *job, bool complete) {
+  regmatch_t match;
+  uint32_t limit = complete ? job->carry_length : job->carry_length - REGEX_OVERLAP;
+  uint32_t start = job->resume > job->carry_offset ? job->resume - job->carry_offset : 0;
+  int flags = REG_STARTEND | (job->carry_bol ? 0 : REG_NOTBOL) | (complete ? 0 : REG_NOTEOL);
+
+  while (start <= job->carry_length) {
+    match.rm_so = start;
+    match.rm_eo = job->carry_length;
+    if (regexec(job->matcher->regex, job->carry, 1, &match, flags) != 0) break;
+    if (!complete && (uint32_t)match.rm_so >= limit) break;
+    if (match.rm_eo > match.rm_so || !job->line_hit) {
+      add_hit(job, job->carry_offset + match.rm_so);
+      job->line_hit = true;
+    }
+    start = match.rm_eo > match.rm_so ? match.rm_eo : match.rm_so + 1;
+    job->resume = job->carry_offset + start;
+    flags |= REG_NOTBOL;
+  }
+
+  if (complete) {
+    job->carry_length = 0;
+    job->carry_bol = true;
+    job->line_hit = false;
+  } else {
+    memmove(job->carry, job->carry + limit, REGEX_OVERLAP);
+    job->carry_offset += limit;
+    job->carry_length = REGEX_OVERLAP;
+    job->carry_bol = false;
+  }
+}
+
+static bool grep_regex(void *ctx, const char *buf, uint32_t length) {
+  GrepJob *job = ctx;
+  const char *p = buf, *end = buf + length;
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    uint32_t take = (newline ? newline : end) - p;
+    if (!job->carry_length) job->carry_offset = job->offset + (p - buf);
+
+    // Overlong line: search it a piece at a time
+    while (job->carry_length + take > MAX_LINE) {
+      uint32_t fill = MAX_LINE - job->carry_length;
+      memcpy(job->carry + job->carry_length, p, fill);
+      job->carry_length = MAX_LINE;
+      p += fill;
+      take -= fill;
+      search_piece(job, false);
+    }
+    memcpy(job->carry + job->carry_length, p, take);
+    job->carry_length += take;
+
+    if (!newline) break;
+    search_piece(job, true);
+    p = newline + 1;
+  }
+  job->offset += length;
+  return true;
+}
+
+static void run_grep_job(void *arg) {
+  GrepJob *job = arg;
+  bool regex = job->matcher->regex != NULL;
+  job->carry = malloc(regex ? MAX_LINE : job->matcher->needle_length);
+  job->carry_bol = true;
+  job->ok = stream_file(job->cursor, &job->file->entry, regex ? grep_regex : grep_fixed, job);
+  if (regex && job->carry_length) search_piece(job, true);
+  free(job->carry);
+}
+
+// grep [-E] <pattern>: prints path:offset for every match in the files
+// under the current directory
+void fs_grep(Cursor *cursor, Word *args) {
+  Matcher matcher = { 0 };
+  regex_t regex;
+  bool extended = false;
+  if (args && strcmp(args->token, "-E") == 0) {
+    extended = true;
+    args = args->next;
+  }
+  if (!args) {
+    disp_error(CODE_5, NULL, 0);
+    return;
+  }
+
+  // The pattern is the rest of the line, single spaced
+  char pattern[MAX_PATTERN] = "";
+  for (; args; args = args->next) {
+    if (*pattern) strncat(pattern, " ", sizeof(pattern) - strlen(pattern) - 1);
+    strncat(pattern, args->token, sizeof(pattern) - strlen(pattern) - 1);
+  }
+  if (extended) {
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
+      disp_error(CODE_5, NULL, 0);
+      return;
+    }
+    matcher.regex = &regex;
+  } else {
+    matcher.needle = pattern;
+    matcher.needle_length = strlen(pattern);
+  }
+
+  FileList list = { 0 };
+  walk_files(cursor, current_cluster(cursor), "", true, &list);
+
+  GrepJob *jobs = calloc(list.count + 1, sizeof(GrepJob));
+  Pool *pool = pool_create(pool_default_threads());
+  int i, j;
+  for (i = 0; i < list.count; i++) {
+    jobs[i].cursor = cursor;
+    jobs[i].file = &list.files[i];
+    jobs[i].matcher = &matcher;
+    pool_submit(pool, run_grep_job, &jobs[i]);
+  }
+  pool_wait(pool);
+  pool_destroy(pool);
+
+  for (i = 0; i < list.count; i++) {
+    for (j = 0; j < jobs[i].hit_count; j++) printf("%s:%u\n", jobs[i].file->path, jobs[i].hits[j]);
+    if (!jobs[i].ok) disp_error(CODE_3, jobs[i].file->path, 0);
+    free(jobs[i].hits);
+  }
+
+  if (extended) regfree(&regex);
+  free(jobs);
+  free_file_list(&list);
+}
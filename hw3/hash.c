@@ -0,0 +1,455 @@
+#include "fat.h"
+#include "hash.h"
+#include "pool.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// Content hashing (hash, hash -r). File data is streamed straight from the
+// cluster chains into the checksum kernels below, one file per pool task.
+
+/********** Dispatch ***********/
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static bool have_crc32_insn;
+static bool have_sha_insn;
+static uint32_t crc32c_table[8][256];
+
+static void init_kernels(void) {
+  uint32_t i, j;
+  for (i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (j = 0; j < 8; j++) crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+  }
+
+#ifdef HAVE_X86
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    have_crc32_insn = ecx & bit_SSE4_2;
+    bool sse41 = ecx & bit_SSE4_1;
+    bool ssse3 = ecx & bit_SSSE3;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+      have_sha_insn = (ebx & bit_SHA) && sse41 && ssse3;
+  }
+#endif
+}
+
+/********** CRC32C ***********/
+
+// Slicing-by-8 over the Castagnoli polynomial
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *p, size_t length) {
+  while (length && ((uintptr_t)p & 7)) {
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    length--;
+  }
+  while (length >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+          crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+          crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length) {
+  uint64_t c = crc;
+  while (length && ((uintptr_t)p & 7)) {
+    c = _mm_crc32_u8(c, *p++);
+    length--;
+  }
+  while (length >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    length -= 8;
+  }
+  while (length--) c = _mm_crc32_u8(c, *p++);
+  return c;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t length) {
+  pthread_once(&kernels_once, init_kernels);
+  crc = ~crc;
+#ifdef HAVE_X86
+  if (have_crc32_insn) return ~crc32c_sse42(crc, buf, length);
+#endif
+  return ~crc32c_portable(crc, buf, length);
+}
+
+/********** SHA-256 ***********/
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t *state, const uint8_t *p, size_t blocks) {
+  while (blocks--) {
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+    int i;
+    for (i = 0; i < 16; i++)
+      w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    for (i = 16; i < 64; i++) {
+      uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+      uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    p += 64;
+  }
+}
+
+#ifdef HAVE_X86
+// SHA extensions: four rounds per pair of sha256rnds2, with the message
+// schedule kept in a ring of four registers
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t *state, const uint8_t *p, size_t blocks) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+  __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);
+  state1 = _mm_shuffle_epi32(state1, 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  while (blocks--) {
+    __m128i abef = state0, cdgh = state1, w[4], msg;
+    int i;
+    for (i = 0; i < 16; i++) {
+      if (i < 4) {
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i * 16)), mask);
+      } else {
+        __m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+        next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+        w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+      }
+      msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    p += 64;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static void sha256_blocks(uint32_t *state, const uint8_t *p, size_t blocks) {
+#ifdef HAVE_X86
+  if (have_sha_insn) {
+    sha256_blocks_shani(state, p, blocks);
+    return;
+  }
+#endif
+  sha256_blocks_portable(state, p, blocks);
+}
+
+void sha256_init(Sha256 *ctx) {
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  pthread_once(&kernels_once, init_kernels);
+  memcpy(ctx->state, iv, sizeof(iv));
+  ctx->length = 0;
+  ctx->fill = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *buf, size_t length) {
+  const uint8_t *p = buf;
+  ctx->length += length;
+  if (ctx->fill) {
+    size_t take = 64 - ctx->fill < length ? 64 - ctx->fill : length;
+    memcpy(ctx->block + ctx->fill, p, take);
+    ctx->fill += take;
+    p += take;
+    length -= take;
+    if (ctx->fill < 64) return;
+    sha256_blocks(ctx->state, ctx->block, 1);
+    ctx->fill = 0;
+  }
+  if (length >= 64) {
+    sha256_blocks(ctx->state, p, length / 64);
+    p += length & ~(size_t)63;
+    length &= 63;
+  }
+  memcpy(ctx->block, p, length);
+  ctx->fill = length;
+}
+
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]) {
+  uint64_t bits = ctx->length * 8;
+  uint8_t pad[72] = { 0x80 };
+  size_t pad_length = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+  int i;
+  for (i = 0; i < 8; i++) pad[pad_length + i] = bits >> (56 - i * 8);
+  sha256_update(ctx, pad, pad_length + 8);
+  for (i = 0; i < 8; i++) {
+    digest[i * 4] = ctx->state[i] >> 24;
+    digest[i * 4 + 1] = ctx->state[i] >> 16;
+    digest[i * 4 + 2] = ctx->state[i] >> 8;
+    digest[i * 4 + 3] = ctx->state[i];
+  }
+}
+
+/********** xxHash64 ***********/
+
+// Four independent lanes already keep a scalar core busy; there is no
+// SIMD variant of this kernel.
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  acc = ROTL64(acc, 31);
+  return acc * XXH_P1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+  acc ^= xxh64_round(0, value);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_stripes(uint64_t *v, const uint8_t *p, size_t stripes) {
+  uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], lane[4];
+  while (stripes--) {
+    memcpy(lane, p, 32);
+    v0 = xxh64_round(v0, lane[0]);
+    v1 = xxh64_round(v1, lane[1]);
+    v2 = xxh64_round(v2, lane[2]);
+    v3 = xxh64_round(v3, lane[3]);
+    p += 32;
+  }
+  v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+}
+
+void xxh64_init(Xxh64 *ctx, uint64_t seed) {
+  ctx->v[0] = seed + XXH_P1 + XXH_P2;
+  ctx->v[1] = seed + XXH_P2;
+  ctx->v[2] = seed;
+  ctx->v[3] = seed - XXH_P1;
+  ctx->length = 0;
+  ctx->fill = 0;
+}
+
+void xxh64_update(Xxh64 *ctx, const void *buf, size_t length) {
+  const uint8_t *p = buf;
+  ctx->length += length;
+  if (ctx->fill) {
+    size_t take = 32 - ctx->fill < length ? 32 - ctx->fill : length;
+    memcpy(ctx->block + ctx->fill, p, take);
+    ctx->fill += take;
+    p += take;
+    length -= take;
+    if (ctx->fill < 32) return;
+    xxh64_stripes(ctx->v, ctx->block, 1);
+    ctx->fill = 0;
+  }
+  if (length >= 32) {
+    xxh64_stripes(ctx->v, p, length / 32);
+    p += length & ~(size_t)31;
+    length &= 31;
+  }
+  memcpy(ctx->block, p, length);
+  ctx->fill = length;
+}
+
+uint64_t xxh64_final(Xxh64 *ctx) {
+  uint64_t h;
+  const uint8_t *p = ctx->block;
+  uint32_t left = ctx->fill;
+
+  if (ctx->length >= 32) {
+    h = ROTL64(ctx->v[0], 1) + ROTL64(ctx->v[1], 7) + ROTL64(ctx->v[2], 12) + ROTL64(ctx->v[3], 18);
+    h = xxh64_merge(h, ctx->v[0]);
+    h = xxh64_merge(h, ctx->v[1]);
+    h = xxh64_merge(h, ctx->v[2]);
+    h = xxh64_merge(h, ctx->v[3]);
+  } else {
+    // No stripe has been mixed in, so lane 2 still holds the seed
+    h = ctx->v[2] + XXH_P5;
+  }
+  h += ctx->length;
+
+  while (left >= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    h ^= xxh64_round(0, k);
+    h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+    p += 8;
+    left -= 8;
+  }
+  if (left >= 4) {
+    uint32_t k;
+    memcpy(&k, p, 4);
+    h ^= (uint64_t)k * XXH_P1;
+    h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+    left -= 4;
+  }
+  while (left--) {
+    h ^= (*p++) * XXH_P5;
+    h = ROTL64(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+/********** Command ***********/
+
+typedef struct {
+  bool use_xxh;
+  uint32_t crc;
+  Sha256 sha;
+  Xxh64 xxh;
+} FileHash;
+
+static bool hash_chunk(void *ctx, const char *buf, uint32_t length) {
+  FileHash *hash = ctx;
+  hash->crc = crc32c_update(hash->crc, buf, length);
+  if (hash->use_xxh) xxh64_update(&hash->xxh, buf, length);
+  else sha256_update(&hash->sha, buf, length);
+  return true;
+}
+
+bool hash_file(Cursor *cursor, Fat16Entry *entry, bool use_xxh, uint32_t *crc, char *digest) {
+  FileHash hash;
+  memset(&hash, 0, sizeof(hash));
+  hash.use_xxh = use_xxh;
+  uint8_t sha[SHA256_DIGEST_LENGTH];
+  int i;
+  if (use_xxh) xxh64_init(&hash.xxh, 0);
+  else sha256_init(&hash.sha);
+  if (!stream_file(cursor, entry, hash_chunk, &hash)) return false;
+
+  *crc = hash.crc;
+  if (use_xxh) {
+    sprintf(digest, "%016llx", (unsigned long long)xxh64_final(&hash.xxh));
+  } else {
+    sha256_final(&hash.sha, sha);
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) sprintf(digest + 2 * i, "%02x", sha[i]);
+  }
+  return true;
+}
+
+typedef struct {
+  Cursor *cursor;
+  FileRef *file;
+  bool use_xxh;
+
+  uint32_t crc;
+  char digest[HASH_HEX_LENGTH];
+  bool ok;
+} HashJob;
+
+static void run_hash_job(void *arg) {
+  HashJob *job = arg;
+  job->ok = hash_file(job->cursor, &job->file->entry, job->use_xxh, &job->crc, job->digest);
+}
+
+// hash [-r] [-x] [-o <host file>]: writes a manifest line per file in the
+// current directory (its whole subtree with -r) holding the CRC32C and the
+// SHA-256, or xxHash64 with -x, of the file's contents
+void fs_hash(Cursor *cursor, Word *args) {
+  bool recursive = false, use_xxh = false;
+  const char *manifest = NULL;
+  for (; args; args = args->next) {
+    if (strcmp(args->token, "-r") == 0) recursive = true;
+    else if (strcmp(args->token, "-x") == 0) use_xxh = true;
+    else if (strcmp(args->token, "-o") == 0 && args->next) manifest = (args = args->next)->token;
+    else {
+      disp_error(CODE_5, NULL, 0);
+      return;
+    }
+  }
+
+  FILE *out = stdout;
+  if (manifest && !(out = fopen(manifest, "w"))) {
+    disp_error(CODE_9, (void *)manifest, 0);
+    return;
+  }
+
+  FileList list = { 0 };
+  walk_files(cursor, current_cluster(cursor), "", recursive, &list);
+
+  HashJob *jobs = calloc(list.count + 1, sizeof(HashJob));
+  Pool *pool = pool_create(pool_default_threads());
+  int i;
+  for (i = 0; i < list.count; i++) {
+    jobs[i].cursor = cursor;
+    jobs[i].file = &list.files[i];
+    jobs[i].use_xxh = use_xxh;
+    pool_submit(pool, run_hash_job, &jobs[i]);
+  }
+  pool_wait(pool);
+  pool_destroy(pool);
+
+  // Emit in walk order so manifests diff cleanly
+  for (i = 0; i < list.count; i++) {
+    HashJob *job = &jobs[i];
+    if (!job->ok) {
+      fprintf(out, "%-8s %s  %s\n", "ERROR", use_xxh ? "----------------" : "-", job->file->path);
+      continue;
+    }
+    fprintf(out, "%08x %s  %s\n", job->crc, job->digest, job->file->path);
+  }
+
+  if (out != stdout) fclose(out);
+  free(jobs);
+  free_file_list(&list);
+}
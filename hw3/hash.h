@@ -0,0 +1,36 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Checksum kernels. Each picks a hardware implementation at first use when
+// the CPU has one (SSE4.2 crc32, SHA extensions) and falls back to portable C.
+
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  uint32_t fill;
+} Sha256;
+
+typedef struct {
+  uint64_t v[4];
+  uint64_t length;
+  uint8_t block[32];
+  uint32_t fill;
+} Xxh64;
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t length);
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *buf, size_t length);
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+void xxh64_init(Xxh64 *ctx, uint64_t seed);
+void xxh64_update(Xxh64 *ctx, const void *buf, size_t length);
+uint64_t xxh64_final(Xxh64 *ctx);
+
+#endif
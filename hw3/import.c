@@ -0,0 +1,552 @@
+#include "fat.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ctype.h>
+
+// Bulk import of host files and trees (cpin, cpin -r).
+// The host tree is scanned first, then every file and directory is placed
+// in a single planning pass over the free runs of the in-memory FAT, and
+// finally data, directory clusters and the FAT copies are written out in
+// large sequential batches.
+
+#define WRITE_BATCH (4 * 1024 * 1024)
+
+typedef struct {
+  uint16_t start;
+  uint16_t length;
+} Extent;
+
+typedef struct host_node_t {
+  char *path;
+  unsigned char name[11];
+  bool isDirectory;
+  uint32_t size;
+  uint16_t modify_time;
+  uint16_t modify_date;
+
+  uint32_t clusters;
+  Extent *extents;
+  int extent_count;
+
+  struct host_node_t *parent;
+  struct host_node_t *children;
+  struct host_node_t *next;
+} HostNode;
+
+// One planned extent, tagged with its owner, for the write phase
+typedef struct {
+  Extent extent;
+  HostNode *node;
+  uint32_t skip;    // clusters of the owner that precede this extent
+} Placement;
+
+typedef struct {
+  Extent *runs;
+  int count;
+  int current;
+} Planner;
+
+typedef struct {
+  Cursor *cursor;
+  char *buf;
+  uint32_t base;
+  uint32_t fill;
+} Batch;
+
+/********** Naming ***********/
+
+// Open-addressed set of 8.3 names used to resolve collisions
+typedef struct {
+  unsigned char (*slots)[11];
+  uint32_t mask;
+} NameSet;
+
+static void init_name_set(NameSet *set, int count) {
+  uint32_t size = 16;
+  while (size < (uint32_t)count * 2) size <<= 1;
+  set->slots = calloc(size, 11);
+  set->mask = size - 1;
+}
+
+static uint32_t name_hash(unsigned char *name) {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < 11; i++) h = (h ^ name[i]) * 16777619u;
+  return h;
+}
+
+static bool name_taken(NameSet *set, unsigned char *name) {
+  uint32_t i = name_hash(name) & set->mask;
+  for (; set->slots[i][0]; i = (i + 1) & set->mask) {
+    if (memcmp(set->slots[i], name, 11) == 0) return true;
+  }
+  return false;
+}
+
+// Callers size the set for every name they add
+static void add_name(NameSet *set, unsigned char *name) {
+  uint32_t i = name_hash(name) & set->mask;
+  while (set->slots[i][0]) i = (i + 1) & set->mask;
+  memcpy(set->slots[i], name, 11);
+}
+
+// Builds an 8.3 name for host_name that isn't in taken
+static void make_short_name(const char *host_name, NameSet *taken, unsigned char *out) {
+  const char *dot = strrchr(host_name, '.');
+  if (dot == host_name) dot = NULL;
+  int base_len = dot ? (int)(dot - host_name) : (int)strlen(host_name);
+  int i, n;
+
+  memset(out, SPACE, 11);
+  for (i = 0, n = 0; i < base_len && n < 8; i++) {
+    unsigned char c = host_name[i];
+    if (c == ' ' || c == '.') continue;
+    out[n++] = isalnum(c) ? toupper(c) : '_';
+  }
+  if (n == 0) out[n++] = '_';
+  for (i = 1, n = 8; dot && dot[i] && n < 11; i++) {
+    unsigned char c = dot[i];
+    out[n++] = isalnum(c) ? toupper(c) : '_';
+  }
+
+  // Resolve collisions with a ~N tail, as DOS does
+  int tail;
+  for (tail = 1; name_taken(taken, out) && tail < 1000000; tail++) {
+    char suffix[9];
+    int len = sprintf(suffix, "~%d", tail);
+    int keep = 0;
+    while (keep < 8 - len && out[keep] != SPACE && out[keep] != '~') keep++;
+    memcpy(out + keep, suffix, len);
+    for (i = keep + len; i < 8; i++) out[i] = SPACE;
+  }
+}
+
+static void dos_time(time_t t, uint16_t *time_out, uint16_t *date_out) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+  if (tm.tm_year < 80) {
+    *time_out = 0;
+    *date_out = (1 << 5) | 1;
+    return;
+  }
+  *time_out = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  *date_out = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+/********** Scan ***********/
+
+// Host directories already scanned, so a tree that reaches one twice
+// (a bind mount, a hard-linked directory) isn't copied forever
+typedef struct {
+  dev_t *devices;
+  ino_t *inodes;
+  int count;
+} Visited;
+
+static bool visit(Visited *visited, struct stat *st) {
+  int i;
+  for (i = 0; i < visited->count; i++) {
+    if (visited->devices[i] == st->st_dev && visited->inodes[i] == st->st_ino) return false;
+  }
+  visited->devices = realloc(visited->devices, sizeof(dev_t) * (visited->count + 1));
+  visited->inodes = realloc(visited->inodes, sizeof(ino_t) * (visited->count + 1));
+  visited->devices[visited->count] = st->st_dev;
+  visited->inodes[visited->count++] = st->st_ino;
+  return true;
+}
+
+// Only regular files and directories are copied. Symlinks inside the tree
+// are not followed; the path named on the command line is.
+static HostNode *scan_host(const char *path, uint32_t csize, bool recursive, int depth, Visited *visited) {
+  struct stat st;
+  if ((depth ? lstat(path, &st) : stat(path, &st)) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) ||
+      depth > MAX_WALK_DEPTH || (S_ISDIR(st.st_mode) && recursive && !visit(visited, &st))) {
+    disp_error(CODE_7, (void *)path, 0);
+    return NULL;
+  }
+
+  HostNode *node = calloc(1, sizeof(HostNode));
+  node->path = strdup(path);
+  dos_time(st.st_mtime, &node->modify_time, &node->modify_date);
+
+  if (!S_ISDIR(st.st_mode)) {
+    if (st.st_size > 0xFFFFFFFFLL) {
+      disp_error(CODE_7, (void *)path, 0);
+      free(node->path);
+      free(node);
+      return NULL;
+    }
+    node->size = st.st_size;
+    node->clusters = (node->size + csize - 1) / csize;
+    return node;
+  }
+
+  node->isDirectory = true;
+  if (!recursive) return node;
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    disp_error(CODE_7, (void *)path, 0);
+    return node;
+  }
+
+  // Entries are kept in host order; names are assigned once all are known
+  HostNode *tail = NULL;
+  int count = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+    char *child_path = malloc(strlen(path) + strlen(ent->d_name) + 2);
+    sprintf(child_path, "%s/%s", path, ent->d_name);
+    HostNode *child = scan_host(child_path, csize, true, depth + 1, visited);
+    free(child_path);
+    if (!child) continue;
+    child->parent = node;
+    if (tail) tail->next = child;
+    else node->children = child;
+    tail = child;
+    count++;
+  }
+  closedir(dir);
+
+  NameSet names;
+  init_name_set(&names, count);
+  HostNode *child;
+  for (child = node->children; child; child = child->next) {
+    const char *base = strrchr(child->path, '/');
+    make_short_name(base ? base + 1 : child->path, &names, child->name);
+    add_name(&names, child->name);
+  }
+  free(names.slots);
+
+  // '.' and '..' plus one slot per child, rounded up to whole clusters
+  node->clusters = ((count + 2) * 32 + csize - 1) / csize;
+  return node;
+}
+
+static void free_host_tree(HostNode *node) {
+  while (node) {
+    HostNode *next = node->next;
+    free_host_tree(node->children);
+    free(node->extents);
+    free(node->path);
+    free(node);
+    node = next;
+  }
+}
+
+/********** Plan ***********/
+
+static void init_planner(Planner *planner, uint16_t *fat, uint32_t clusters) {
+  uint32_t c, last = clusters + 2;
+  memset(planner, 0, sizeof(Planner));
+  planner->runs = malloc(sizeof(Extent) * (clusters / 2 + 1));
+  for (c = 2; c < last; c++) {
+    if (fat[c] != 0) continue;
+    uint32_t start = c;
+    while (c < last && fat[c] == 0) c++;
+    planner->runs[planner->count].start = start;
+    planner->runs[planner->count].length = c - start;
+    planner->count++;
+  }
+}
+
+static uint32_t free_clusters(Planner *planner) {
+  uint32_t total = 0;
+  int i;
+  for (i = 0; i < planner->count; i++) total += planner->runs[i].length;
+  return total;
+}
+
+static void add_extent(HostNode *node, uint16_t start, uint16_t length) {
+  node->extents = realloc(node->extents, sizeof(Extent) * (node->extent_count + 1));
+  node->extents[node->extent_count].start = start;
+  node->extents[node->extent_count].length = length;
+  node->extent_count++;
+}
+
+// Next-fit: continue from the current run so that consecutive nodes stay
+// adjacent, skipping ahead to the first run that holds the node whole.
+// Only when no single run is large enough is the node split.
+static void place(Planner *planner, HostNode *node) {
+  uint32_t need = node->clusters;
+  int i;
+  if (need == 0) return;
+
+  for (i = 0; i < planner->count; i++) {
+    Extent *run = &planner->runs[(planner->current + i) % planner->count];
+    if (run->length >= need) {
+      add_extent(node, run->start, need);
+      run->start += need;
+      run->length -= need;
+      planner->current = (planner->current + i) % planner->count;
+      return;
+    }
+  }
+
+  for (i = 0; need > 0; i = (i + 1) % planner->count) {
+    Extent *run = &planner->runs[(planner->current + i) % planner->count];
+    if (run->length == 0) continue;
+    uint32_t take = run->length < need ? run->length : need;
+    add_extent(node, run->start, take);
+    run->start += take;
+    run->length -= take;
+    need -= take;
+  }
+}
+
+// Each directory is placed immediately ahead of its own files, then its
+// subdirectories follow depth-first
+static void plan_tree(Planner *planner, HostNode *node) {
+  place(planner, node);
+  HostNode *child;
+  for (child = node->children; child; child = child->next) {
+    if (!child->isDirectory) place(planner, child);
+  }
+  for (child = node->children; child; child = child->next) {
+    if (child->isDirectory) plan_tree(planner, child);
+  }
+}
+
+static uint32_t total_clusters(HostNode *node) {
+  uint32_t total = 0;
+  for (; node; node = node->next) total += node->clusters + total_clusters(node->children);
+  return total;
+}
+
+static int count_placements(HostNode *node) {
+  int total = 0;
+  for (; node; node = node->next) total += node->extent_count + count_placements(node->children);
+  return total;
+}
+
+static void collect_placements(HostNode *node, Placement *out, int *n) {
+  for (; node; node = node->next) {
+    uint32_t skip = 0;
+    int i;
+    for (i = 0; i < node->extent_count; i++) {
+      out[*n].extent = node->extents[i];
+      out[*n].node = node;
+      out[*n].skip = skip;
+      skip += node->extents[i].length;
+      (*n)++;
+    }
+    collect_placements(node->children, out, n);
+  }
+}
+
+static int compare_placements(const void *a, const void *b) {
+  return (int)((const Placement *)a)->extent.start - (int)((const Placement *)b)->extent.start;
+}
+
+static uint16_t first_cluster(HostNode *node) {
+  return node->extent_count ? node->extents[0].start : 0;
+}
+
+static void chain_extents(uint16_t *fat, HostNode *node) {
+  for (; node; node = node->next) {
+    int i;
+    for (i = 0; i < node->extent_count; i++) {
+      uint32_t c = node->extents[i].start;
+      uint32_t end = c + node->extents[i].length;
+      for (; c + 1 < end; c++) fat[c] = c + 1;
+      fat[c] = (i + 1 < node->extent_count) ? node->extents[i + 1].start : 0xFFFF;
+    }
+    chain_extents(fat, node->children);
+  }
+}
+
+/********** Write ***********/
+
+static void fill_entry(Fat16Entry *entry, HostNode *node) {
+  memset(entry, 0, sizeof(Fat16Entry));
+  memcpy(entry->name, node->name, 11);
+  entry->attributes = node->isDirectory ? DIR_ATTR_DIRECTORY : DIR_ATTR_ARCHIVE;
+  entry->modify_time = node->modify_time;
+  entry->modify_date = node->modify_date;
+  entry->starting_cluster = first_cluster(node);
+  entry->size = node->isDirectory ? 0 : node->size;
+}
+
+static bool flush_batch(Batch *batch) {
+  bool ok = true;
+  if (batch->fill) ok = write_data(batch->cursor, batch->base, batch->fill, batch->buf);
+  batch->fill = 0;
+  return ok;
+}
+
+// Returns room for length bytes at image offset address, extending the
+// pending write when it is contiguous with it
+static char *reserve_batch(Batch *batch, uint32_t address, uint32_t length, bool *ok) {
+  if (batch->fill && (batch->base + batch->fill != address || batch->fill + length > WRITE_BATCH))
+    *ok = flush_batch(batch) && *ok;
+  if (!batch->fill) batch->base = address;
+  char *room = batch->buf + batch->fill;
+  batch->fill += length;
+  return room;
+}
+
+// Serializes a directory's clusters: '.', '..' and one entry per child
+static char *build_directory(HostNode *node, uint16_t parent_cluster, uint32_t csize) {
+  char *data = calloc(node->clusters, csize);
+  Fat16Entry *entries = (Fat16Entry *)data;
+  HostNode *child;
+  int n = 2;
+
+  fill_entry(&entries[0], node);
+  memcpy(entries[0].name, ".          ", 11);
+  fill_entry(&entries[1], node);
+  memcpy(entries[1].name, "..         ", 11);
+  entries[1].starting_cluster = parent_cluster;
+  for (child = node->children; child; child = child->next) fill_entry(&entries[n++], child);
+  return data;
+}
+
+static bool write_placement(Batch *batch, BPB *bpb, Placement *p, uint16_t root_parent) {
+  uint32_t csize = cluster_size(bpb);
+  uint32_t address = cluster_address(bpb, p->extent.start);
+  uint32_t length = p->extent.length * csize;
+  HostNode *node = p->node;
+  bool ok = true;
+
+  if (node->isDirectory) {
+    uint16_t parent = node->parent ? first_cluster(node->parent) : root_parent;
+    char *data = build_directory(node, parent, csize);
+    uint32_t done;
+    for (done = 0; done < length; done += csize) {
+      memcpy(reserve_batch(batch, address + done, csize, &ok), data + (p->skip * csize) + done, csize);
+    }
+    free(data);
+    return ok;
+  }
+
+  FILE *in = fopen(node->path, "rb");
+  if (!in) {
+    disp_error(CODE_7, node->path, 0);
+    return false;
+  }
+  if (fseek(in, (long)p->skip * csize, SEEK_SET) != 0) ok = false;
+
+  // Stream the extent through the batch buffer, padding the last cluster
+  uint32_t done = 0;
+  while (ok && done < length) {
+    uint32_t chunk = length - done;
+    if (chunk > WRITE_BATCH) chunk = WRITE_BATCH;
+    char *room = reserve_batch(batch, address + done, chunk, &ok);
+    size_t got = fread(room, 1, chunk, in);
+    if (got < chunk) memset(room + got, 0, chunk - got);
+    done += chunk;
+  }
+  fclose(in);
+  return ok;
+}
+
+/********** Command ***********/
+
+// cpin [-r] <host path>: copies a host file, or a whole tree with -r, into
+// the current directory
+void fs_cpin(Cursor *cursor, Word *args) {
+  BPB *bpb = cursor->bpb;
+  bool recursive = false;
+  if (args && strcmp(args->token, "-r") == 0) {
+    recursive = true;
+    args = args->next;
+  }
+  if (!args) {
+    disp_error(CODE_5, NULL, 0);
+    return;
+  }
+
+  uint32_t csize = cluster_size(bpb);
+  Visited visited = { 0 };
+  HostNode *root = scan_host(args->token, csize, recursive, 0, &visited);
+  free(visited.devices);
+  free(visited.inodes);
+  if (!root) return;
+  if (root->isDirectory && !recursive) {
+    disp_error(CODE_5, NULL, 0);
+    free_host_tree(root);
+    return;
+  }
+
+  // Pick a name that doesn't clash with what's already in the target
+  EntryNode *target = cursor->current;
+  if (!target->children) target->children = fs_ls(cursor, NULL);
+  int existing = 0;
+  EntryNode *child;
+  for (child = target->children; child; child = child->next) existing++;
+  NameSet names;
+  init_name_set(&names, existing);
+  for (child = target->children; child; child = child->next) {
+    // Undo format_entry so names compare in their on-disk form
+    unsigned char name[11];
+    int j;
+    memcpy(name, child->entry->name, 11);
+    for (j = 0; j < 8; j++) if (name[j] == '\0') name[j] = SPACE;
+    add_name(&names, name);
+  }
+  char *leaf = strdup(args->token);
+  int len = strlen(leaf);
+  while (len > 1 && leaf[len - 1] == '/') leaf[--len] = '\0';
+  char *base = strrchr(leaf, '/');
+  make_short_name(base ? base + 1 : leaf, &names, root->name);
+  free(leaf);
+  free(names.slots);
+
+  uint32_t slot = find_free_slot(cursor, target);
+  if (!slot) {
+    disp_error(CODE_8, NULL, 0);
+    free_host_tree(root);
+    return;
+  }
+
+  // Plan every cluster up front
+  uint16_t *fat = load_fat(cursor);
+  Planner planner;
+  init_planner(&planner, fat, cluster_count(bpb));
+  if (total_clusters(root) > free_clusters(&planner)) {
+    disp_error(CODE_8, NULL, 0);
+    free(planner.runs);
+    free_host_tree(root);
+    return;
+  }
+  plan_tree(&planner, root);
+  free(planner.runs);
+
+  // Write data and directory clusters in image order
+  int count = count_placements(root), n = 0;
+  Placement *placements = malloc(sizeof(Placement) * (count + 1));
+  collect_placements(root, placements, &n);
+  qsort(placements, count, sizeof(Placement), compare_placements);
+
+  uint16_t root_parent = target->isRoot ? 0 : target->entry->starting_cluster;
+  Batch batch = { cursor, malloc(WRITE_BATCH), 0, 0 };
+  bool ok = true;
+  int i;
+  for (i = 0; i < count && ok; i++) ok = write_placement(&batch, bpb, &placements[i], root_parent);
+  ok = flush_batch(&batch) && ok;
+  free(batch.buf);
+  free(placements);
+
+  // Only link the new tree in once its contents are on the image
+  if (ok) {
+    chain_extents(fat, root);
+    ok = store_fat(cursor);
+  }
+  if (ok) {
+    Fat16Entry entry;
+    fill_entry(&entry, root);
+    ok = write_meta(cursor, slot, sizeof(entry), &entry);
+  }
+  // The whole import reaches the image's metadata as one journaled batch
+  ok = ok && sync_image(cursor);
+  if (!ok) {
+    // Drop the unsaved allocations so the in-memory FAT matches the image
+    free(cursor->fat);
+    cursor->fat = NULL;
+  }
+
+  target->children = fs_ls(cursor, NULL);
+  free_host_tree(root);
+}
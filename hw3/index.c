@@ -0,0 +1,230 @@
+#include "index.h"
+#include "hash.h"
+#include "device.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+typedef struct {
+  IndexDir dir;
+  char *data;
+} Collected;
+
+typedef struct {
+  Collected *dirs;
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t *visited;          // directory clusters already collected
+} Collection;
+
+static uint64_t bpb_hash(BPB *bpb) {
+  Xxh64 ctx;
+  xxh64_init(&ctx, 0);
+  xxh64_update(&ctx, bpb, sizeof(BPB));
+  return xxh64_final(&ctx);
+}
+
+static uint64_t payload_hash(const char *map, size_t size) {
+  Xxh64 ctx;
+  xxh64_init(&ctx, 0);
+  xxh64_update(&ctx, map + sizeof(IndexHeader), size - sizeof(IndexHeader));
+  return xxh64_final(&ctx);
+}
+
+/********** Loading ***********/
+
+static bool index_valid(Cursor *cursor, const char *map, size_t size) {
+  const IndexHeader *header = (const IndexHeader *)map;
+  struct stat st;
+  if (size < sizeof(IndexHeader) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION)
+    return false;
+  if (stat(cursor->image_path, &st) != 0 || (uint64_t)st.st_size != header->image_size ||
+      st.st_mtim.tv_sec != header->mtime_sec || st.st_mtim.tv_nsec != header->mtime_nsec)
+    return false;
+  if (header->bpb_hash != bpb_hash(cursor->bpb)) return false;
+  if (header->fat_offset + header->fat_compressed > size ||
+      header->dirs_offset + (uint64_t)header->dir_count * sizeof(IndexDir) > size)
+    return false;
+
+  const IndexDir *dirs = (const IndexDir *)(map + header->dirs_offset);
+  uint32_t i;
+  for (i = 0; i < header->dir_count; i++) {
+    if (dirs[i].offset + dirs[i].length > size) return false;
+  }
+  return header->payload_hash == payload_hash(map, size);
+}
+
+static void map_index(Cursor *cursor, MetaIndex *index) {
+  struct stat st;
+  int fd = open(index->path, O_RDONLY);
+  if (fd < 0) return;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(IndexHeader)) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      index->map = map;
+      index->size = st.st_size;
+    }
+  }
+  close(fd);
+
+  // A stale index is replaced when the session ends
+  if (index->map && !index_valid(cursor, index->map, index->size)) drop_index(cursor);
+  if (!index->map) index->rebuild = true;
+}
+
+void load_index(Cursor *cursor) {
+  // An overlay's contents depend on two files; their mtimes can't vouch for it
+  if (is_overlay(cursor->device)) return;
+
+  char *path = sidecar_path(cursor->image_path, INDEX_SUFFIX);
+  if (access(path, F_OK) != 0) {
+    free(path);
+    return;
+  }
+  cursor->index = calloc(1, sizeof(MetaIndex));
+  cursor->index->path = path;
+  map_index(cursor, cursor->index);
+}
+
+void drop_index(Cursor *cursor) {
+  MetaIndex *index = cursor->index;
+  if (!index || !index->map) return;
+  munmap(index->map, index->size);
+  index->map = NULL;
+  index->rebuild = true;
+}
+
+static const IndexDir *find_dir(MetaIndex *index, uint16_t cluster) {
+  const IndexHeader *header = (const IndexHeader *)index->map;
+  const IndexDir *dirs = (const IndexDir *)(index->map + header->dirs_offset);
+  uint32_t low = 0, high = header->dir_count;
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (dirs[mid].cluster < cluster) low = mid + 1;
+    else high = mid;
+  }
+  return low < header->dir_count && dirs[low].cluster == cluster ? &dirs[low] : NULL;
+}
+
+bool index_dir_data(Cursor *cursor, uint16_t cluster, char **data, uint32_t *length) {
+  MetaIndex *index = cursor->index;
+  if (!index || !index->map) return false;
+  const IndexDir *dir = find_dir(index, cluster);
+  if (!dir) return false;
+  *data = malloc(dir->length ? dir->length : 1);
+  memcpy(*data, index->map + dir->offset, dir->length);
+  *length = dir->length;
+  return true;
+}
+
+bool index_fat(Cursor *cursor, uint16_t *fat, uint32_t length) {
+  MetaIndex *index = cursor->index;
+  if (!index || !index->map) return false;
+  const IndexHeader *header = (const IndexHeader *)index->map;
+  uLongf out = length;
+  return header->fat_length == length &&
+      uncompress((Bytef *)fat, &out, (const Bytef *)index->map + header->fat_offset, header->fat_compressed) == Z_OK &&
+      out == length;
+}
+
+/********** Saving ***********/
+
+static void collect_dir(Cursor *cursor, Collection *c, uint16_t cluster, int depth) {
+  uint32_t length, i;
+  char *data = read_dir_data(cursor, cluster, &length);
+
+  if (c->count == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 64;
+    c->dirs = realloc(c->dirs, sizeof(Collected) * c->capacity);
+  }
+  Collected dir = { { cluster, 0, length, 0 }, data };
+  c->dirs[c->count++] = dir;
+
+  for (i = 0; i + 32 <= length && depth < MAX_WALK_DEPTH; i += 32) {
+    Fat16Entry *entry = (Fat16Entry *)(data + i);
+    if (entry->name[0] == 0) break;
+    if (entry->name[0] == UNUSED_FLAG || entry->name[0] == '.') continue;
+    if ((entry->attributes & DIR_ATTR_LFN) == DIR_ATTR_LFN || entry->attributes & DIR_ATTR_VOLUMEID) continue;
+    if (!(entry->attributes & DIR_ATTR_DIRECTORY) || entry->starting_cluster < 2) continue;
+
+    uint16_t child = entry->starting_cluster;
+    if (child >= cluster_count(cursor->bpb) + 2 || c->visited[child >> 6] >> (child & 63) & 1) continue;
+    c->visited[child >> 6] |= 1ULL << (child & 63);
+    collect_dir(cursor, c, child, depth + 1);
+  }
+}
+
+static int compare_collected(const void *a, const void *b) {
+  return (int)((const Collected *)a)->dir.cluster - (int)((const Collected *)b)->dir.cluster;
+}
+
+bool save_index(Cursor *cursor) {
+  MetaIndex *index = cursor->index;
+  BPB *bpb = cursor->bpb;
+  struct stat st;
+  uint32_t i;
+  if (is_overlay(cursor->device)) return false;
+  if (!sync_image(cursor) || stat(cursor->image_path, &st) != 0) return false;
+  if (!index) {
+    index = cursor->index = calloc(1, sizeof(MetaIndex));
+    index->path = sidecar_path(cursor->image_path, INDEX_SUFFIX);
+  }
+
+  // Compress the FAT; it is mostly runs of consecutive cluster numbers
+  uint32_t fat_length = fat_size(bpb) * bpb->bytes_per_sector;
+  uLongf fat_compressed = compressBound(fat_length);
+  Bytef *fat = malloc(fat_compressed);
+  if (compress2(fat, &fat_compressed, (const Bytef *)load_fat(cursor), fat_length, Z_BEST_SPEED) != Z_OK) {
+    free(fat);
+    return false;
+  }
+
+  Collection c = { 0 };
+  c.visited = calloc((cluster_count(bpb) + 2) / 64 + 1, sizeof(uint64_t));
+  collect_dir(cursor, &c, 0, 0);
+  qsort(c.dirs, c.count, sizeof(Collected), compare_collected);
+
+  // Header, directory table, directory slots, then the FAT
+  IndexHeader header = { INDEX_MAGIC, INDEX_VERSION, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+      bpb_hash(bpb), 0, 0, 0, 0, 0, 0, 0 };
+  uint64_t offset = sizeof(IndexHeader) + (uint64_t)c.count * sizeof(IndexDir);
+  for (i = 0; i < c.count; i++) {
+    c.dirs[i].dir.offset = offset;
+    offset += c.dirs[i].dir.length;
+  }
+  header.dirs_offset = sizeof(IndexHeader);
+  header.dir_count = c.count;
+  header.fat_offset = offset;
+  header.fat_compressed = fat_compressed;
+  header.fat_length = fat_length;
+
+  size_t size = offset + fat_compressed;
+  char *buf = malloc(size);
+  for (i = 0; i < c.count; i++) {
+    memcpy(buf + header.dirs_offset + i * sizeof(IndexDir), &c.dirs[i].dir, sizeof(IndexDir));
+    memcpy(buf + c.dirs[i].dir.offset, c.dirs[i].data, c.dirs[i].dir.length);
+    free(c.dirs[i].data);
+  }
+  memcpy(buf + header.fat_offset, fat, fat_compressed);
+  header.payload_hash = payload_hash(buf, size);
+  memcpy(buf, &header, sizeof(header));
+
+  // Written aside and renamed, so readers never map half an index
+  char *tmp = sidecar_path(index->path, ".tmp");
+  bool ok = write_sidecar(tmp, buf, size) && rename(tmp, index->path) == 0 && sync_parent(index->path);
+  if (!ok) unlink(tmp);
+
+  free(tmp);
+  free(buf);
+  free(fat);
+  free(c.dirs);
+  free(c.visited);
+
+  if (ok) {
+    drop_index(cursor);
+    index->rebuild = false;
+    map_index(cursor, index);
+  }
+  return ok;
+}
@@ -0,0 +1,66 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "fat.h"
+
+// Persisted metadata index (<image>.idx). It holds the FAT, compressed,
+// and the entry slots of every directory reachable from the root, so a
+// fresh process can answer ls/cd/walks without reading the image. It is
+// only trusted while the image's size, mtime and boot sector match what
+// was recorded, and while its own checksum holds.
+//
+// The index is opt-in: the index command writes one, and from then on it
+// is rebuilt on exit whenever the session changed the image. The first
+// write in a session stops it from being used.
+
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC 0x58444946
+#define INDEX_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t image_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t bpb_hash;          // xxHash64 of the BPB
+  uint64_t payload_hash;      // xxHash64 of everything after the header
+
+  uint64_t fat_offset;        // zlib stream
+  uint32_t fat_compressed;
+  uint32_t fat_length;
+  uint64_t dirs_offset;       // IndexDir table, sorted by cluster
+  uint32_t dir_count;
+  uint32_t reserved;
+} IndexHeader;
+
+typedef struct {
+  uint16_t cluster;           // 0 for the root
+  uint16_t reserved;
+  uint32_t length;
+  uint64_t offset;
+} IndexDir;
+
+struct meta_index_t {
+  char *path;
+  char *map;                  // NULL once stale or dropped
+  size_t size;
+  bool rebuild;               // the image changed; write a new index on exit
+};
+
+// Maps <image>.idx if it exists, leaving cursor->index NULL otherwise
+void load_index(Cursor *cursor);
+
+// Stops using the index because the image is about to change
+void drop_index(Cursor *cursor);
+
+// Writes a fresh index for the image as it is now
+bool save_index(Cursor *cursor);
+
+// Copies a directory's slots out of the index; false if it isn't there
+bool index_dir_data(Cursor *cursor, uint16_t cluster, char **data, uint32_t *length);
+
+// Decompresses the FAT into fat; false if the index can't provide it
+bool index_fat(Cursor *cursor, uint16_t *fat, uint32_t length);
+
+#endif
@@ -0,0 +1,87 @@
+#include "journal.h"
+#include "hash.h"
+#include "device.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+bool journal_commit(const char *path, uint32_t sector_size, SectorWrite *writes, uint32_t count) {
+  uint32_t record = sizeof(uint32_t) + sector_size, i;
+  size_t length = sizeof(JournalHeader) + (size_t)count * record;
+  char *buf = malloc(length);
+  char *body = buf + sizeof(JournalHeader);
+
+  for (i = 0; i < count; i++) {
+    memcpy(body + (size_t)i * record, &writes[i].sector, sizeof(uint32_t));
+    memcpy(body + (size_t)i * record + sizeof(uint32_t), writes[i].data, sector_size);
+  }
+  JournalHeader header = { JOURNAL_MAGIC, sector_size, count,
+      crc32c_update(0, body, length - sizeof(JournalHeader)) };
+  memcpy(buf, &header, sizeof(header));
+
+  // The checksum tells a complete journal from a torn one, so one sync of
+  // the file will do; the directory is synced so the journal is still
+  // there to replay if the image is torn
+  bool ok = write_sidecar(path, buf, length);
+  free(buf);
+  return ok;
+}
+
+bool journal_clear(const char *path) {
+  // The removal must be durable too, or a crash could bring the journal
+  // back to be replayed over metadata changed since
+  if (unlink(path) == 0) return sync_parent(path);
+  return errno == ENOENT;
+}
+
+// Reads the journal at path, or returns NULL if it is missing or incomplete
+static char *read_journal(const char *path, JournalHeader *header, uint32_t sector_size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return NULL;
+
+  struct stat st;
+  char *body = NULL;
+  bool ok = fstat(fileno(file), &st) == 0 && fread(header, sizeof(*header), 1, file) == 1 &&
+      header->magic == JOURNAL_MAGIC && header->sector_size == sector_size &&
+      st.st_size == (off_t)(sizeof(*header) + (uint64_t)header->count * (sizeof(uint32_t) + sector_size));
+  if (ok) {
+    size_t length = st.st_size - sizeof(*header);
+    body = malloc(length ? length : 1);
+    ok = fread(body, 1, length, file) == length && crc32c_update(0, body, length) == header->checksum;
+  }
+  fclose(file);
+  if (!ok) {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
+
+void replay_journal(Cursor *cursor) {
+  char *path = sidecar_path(cursor->image_path, JOURNAL_SUFFIX);
+  if (access(path, F_OK) != 0) {
+    free(path);
+    return;
+  }
+
+  uint32_t sector_size = cursor->bpb->bytes_per_sector;
+  uint32_t record = sizeof(uint32_t) + sector_size, i;
+  JournalHeader header;
+  char *body = read_journal(path, &header, sector_size);
+  bool ok = true;
+
+  // A journal that never finished committing means the image wasn't touched
+  if (body) {
+    for (i = 0; i < header.count && ok; i++) {
+      uint32_t sector;
+      memcpy(&sector, body + (size_t)i * record, sizeof(sector));
+      ok = write_bytes(cursor->device, sector * sector_size, sector_size,
+          body + (size_t)i * record + sizeof(uint32_t));
+    }
+    ok = ok && cursor->device->sync(cursor->device);
+    if (ok) printf("journal: replayed %u sectors\n", header.count);
+  }
+  if (ok) journal_clear(path);
+  else disp_error(CODE_9, path, 0);
+  free(body);
+  free(path);
+}
@@ -0,0 +1,43 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "fat.h"
+
+// Metadata journal. Before the cache writes dirty metadata back to the
+// image, the whole batch is written to a sidecar file next to the image
+// and synced; only then is the image touched, and the journal is removed
+// once the image is synced too. If the program dies in between, the next
+// open finds a complete journal and writes the batch again, so the FAT
+// and directories always move from one consistent state to the next.
+//
+// File data never goes through the journal. It is written in place before
+// the metadata that points at it, and the image is synced before each
+// journal commit.
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC 0x4C4E524A
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sector_size;
+  uint32_t count;         // sectors; each is its number followed by its data
+  uint32_t checksum;      // CRC32C over everything after the header
+} JournalHeader;
+
+// One sector to write back to the image
+typedef struct {
+  uint32_t sector;
+  char *data;
+} SectorWrite;
+
+// Makes the batch durable in the journal at path
+bool journal_commit(const char *path, uint32_t sector_size, SectorWrite *writes, uint32_t count);
+
+// Removes the journal once its batch is on the image
+bool journal_clear(const char *path);
+
+// Applies a committed journal left behind by an interrupted flush. Must
+// run before the cache is created.
+void replay_journal(Cursor *cursor);
+
+#endif
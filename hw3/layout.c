@@ -0,0 +1,129 @@
+#include "fat.h"
+
+// Layout report (layout). Walks the tree once and the in-memory FAT once
+// and prints JSON describing how fragmented the volume is.
+
+// Histogram buckets are powers of two: 1, 2, 3-4, 5-8, ...
+#define BUCKETS 17
+
+typedef struct {
+  uint32_t counts[BUCKETS];
+} Histogram;
+
+static int bucket_of(uint32_t n) {
+  int b = 0;
+  while (b + 1 < BUCKETS && n > (1u << b)) b++;
+  return b;
+}
+
+static void print_histogram(FILE *out, const char *name, Histogram *h) {
+  int b, first = 1;
+  fprintf(out, "  \"%s\": {", name);
+  for (b = 0; b < BUCKETS; b++) {
+    if (!h->counts[b]) continue;
+    uint32_t low = b == 0 ? 1 : (1u << (b - 1)) + 1, high = 1u << b;
+    if (low == high) fprintf(out, "%s\"%u\": %u", first ? "" : ", ", low, h->counts[b]);
+    else if (b + 1 == BUCKETS) fprintf(out, "%s\"%u+\": %u", first ? "" : ", ", low, h->counts[b]);
+    else fprintf(out, "%s\"%u-%u\": %u", first ? "" : ", ", low, high, h->counts[b]);
+    first = 0;
+  }
+  fprintf(out, "},\n");
+}
+
+// layout [-o <host file>]: prints the volume's layout report as JSON
+void fs_layout(Cursor *cursor, Word *args) {
+  FILE *out = stdout;
+  if (args && strcmp(args->token, "-o") == 0 && args->next) {
+    if (!(out = fopen(args->next->token, "w"))) {
+      disp_error(CODE_9, args->next->token, 0);
+      return;
+    }
+  } else if (args) {
+    disp_error(CODE_5, NULL, 0);
+    return;
+  }
+
+  BPB *bpb = cursor->bpb;
+  uint16_t *fat = load_fat(cursor);
+  uint32_t csize = cluster_size(bpb);
+  uint32_t last = cluster_count(bpb) + 2;
+  uint32_t c, i;
+
+  // Free space runs
+  Histogram free_runs = { { 0 } };
+  uint32_t free_total = 0, run_count = 0, largest = 0, largest_start = 0, bad = 0;
+  for (c = 2; c < last; c++) {
+    if (fat[c] == 0xFFF7) bad++;
+    if (fat[c] != 0) continue;
+    uint32_t start = c;
+    while (c < last && fat[c] == 0) c++;
+    uint32_t length = c - start;
+    free_runs.counts[bucket_of(length)]++;
+    free_total += length;
+    run_count++;
+    if (length > largest) {
+      largest = length;
+      largest_start = start;
+    }
+  }
+
+  // Per-file extents, seek distance and slack
+  FileList list = { 0 };
+  walk_files(cursor, 0, "", true, &list);
+  Histogram extents = { { 0 } };
+  uint64_t slack = 0, allocated = 0, seek_sum = 0;
+  uint32_t fragmented = 0, seek_files = 0;
+  double seek_avg_sum = 0;
+  fprintf(out, "{\n  \"fragmented_files\": [");
+  for (i = 0; i < (uint32_t)list.count; i++) {
+    Fat16Entry *entry = &list.files[i].entry;
+    uint32_t clusters = 0, runs = 0, budget = last;
+    uint64_t distance = 0;
+    uint32_t prev = 0;
+    for (c = entry->starting_cluster; c >= 2 && c < last && budget-- > 0; c = fat[c]) {
+      // Distance the head travels between consecutive clusters
+      if (clusters == 0 || c != prev + 1) runs++;
+      if (clusters > 0 && c != prev + 1) distance += (uint64_t)(c > prev ? c - prev - 1 : prev + 1 - c) * csize;
+      prev = c;
+      clusters++;
+    }
+    if (!clusters) continue;
+
+    extents.counts[bucket_of(runs)]++;
+    allocated += (uint64_t)clusters * csize;
+    if ((uint64_t)clusters * csize >= entry->size) slack += (uint64_t)clusters * csize - entry->size;
+    if (clusters > 1) {
+      seek_files++;
+      seek_avg_sum += (double)distance / (clusters - 1);
+      seek_sum += distance;
+    }
+    if (runs > 1) {
+      fprintf(out, "%s\n    {\"path\": ", fragmented ? "," : "");
+      print_json_string(out, list.files[i].path);
+      fprintf(out, ", \"size\": %u, \"clusters\": %u, \"extents\": %u, \"avg_seek_bytes\": %.1f}",
+          entry->size, clusters, runs, (double)distance / (clusters - 1));
+      fragmented++;
+    }
+  }
+  fprintf(out, "%s],\n", fragmented ? "\n  " : "");
+
+  fprintf(out, "  \"bytes_per_cluster\": %u,\n", csize);
+  fprintf(out, "  \"clusters\": %u,\n", last - 2);
+  fprintf(out, "  \"free_clusters\": %u,\n", free_total);
+  fprintf(out, "  \"bad_clusters\": %u,\n", bad);
+  fprintf(out, "  \"files\": %d,\n", list.count);
+  fprintf(out, "  \"fragmented\": %u,\n", fragmented);
+  print_histogram(out, "extents_per_file", &extents);
+  fprintf(out, "  \"free_runs\": %u,\n", run_count);
+  print_histogram(out, "free_run_clusters", &free_runs);
+  fprintf(out, "  \"largest_free_run\": {\"start\": %u, \"clusters\": %u, \"bytes\": %llu},\n",
+      largest_start, largest, (unsigned long long)largest * csize);
+  fprintf(out, "  \"avg_seek_bytes\": %.1f,\n", seek_files ? seek_avg_sum / seek_files : 0.0);
+  fprintf(out, "  \"total_seek_bytes\": %llu,\n", (unsigned long long)seek_sum);
+  fprintf(out, "  \"allocated_bytes\": %llu,\n", (unsigned long long)allocated);
+  fprintf(out, "  \"slack_bytes\": %llu,\n", (unsigned long long)slack);
+  fprintf(out, "  \"slack_ratio\": %.4f\n}\n", allocated ? (double)slack / allocated : 0.0);
+
+  if (out != stdout) fclose(out);
+  free_file_list(&list);
+}
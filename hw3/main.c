@@ -6,19 +6,21 @@ Source for reading bytes of file: http://stackoverflow.com/questions/22059189/re
 
 #include "fat.h"
 #include "shell.h"
+#include "cache.h"
+#include "journal.h"
+#include "device.h"
+#include "index.h"
 
 void run_shell(Cursor *cursor) {	
-  FILE *fat_file = cursor->fat_file;
   BPB *boot_sector = cursor->bpb;
 
-	// Read the root directory
-	EntryNode *current = malloc(sizeof(EntryNode));
+	// The root's entries are read by the first command that needs them
+	EntryNode *current = calloc(1, sizeof(EntryNode));
 	current->isRoot = 1;
   cursor->current = current;
   cursor->path = malloc(sizeof(Word));
   cursor->path->token = "/";
   cursor->path->next = NULL;
-	current->children = fs_ls(cursor, NULL);
   
 	char buffer[COMMAND_LENGTH];
   	Input input;
@@ -48,29 +50,44 @@ void run_shell(Cursor *cursor) {
 }
 
 int main(int argc, char **argv) {
-	// Make sure we are supplied a filename
+	// Usage: fat [-o <delta>] <image>, or fat --batch <op> ... <image>...
+	if (argc >= 2 && strcmp(argv[1], "--batch") == 0) return run_batch(argc - 2, argv + 2);
+	char *delta = NULL;
+	if (argc >= 3 && strcmp(argv[1], "-o") == 0) {
+		delta = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc < 2) disp_error(CODE_0, NULL, 1);
 	char *filename = argv[1];
 
-	FILE *fat_file = fopen(filename, "r");
-	if (fat_file == NULL) {
-		disp_error(CODE_1, filename, 1);
+	// Open for update when we can; read-only and compressed images still
+	// browse fine. With -o the image is never written: changes go to the
+	// delta file.
+	Device *device = delta ? overlay_open(filename, delta) : image_open(filename);
+	if (device == NULL) {
+		disp_error(CODE_1, delta ? delta : filename, 1);
 	}
 
 	// Initialize and setup BootSector
 	BPB boot_sector;
-	init_boot_sector(&boot_sector, fat_file);
+	init_boot_sector(&boot_sector, device);
 	
-  // Initialize and setup cursor
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->fat_file = fat_file;
+  // Initialize and setup cursor. Sidecar files belong to whatever is written.
+  Cursor *cursor = calloc(1, sizeof(Cursor));
+  cursor->device = device;
+  cursor->image_path = delta ? delta : filename;
   cursor->bpb = &boot_sector;
+  replay_journal(cursor);
+  cursor->cache = cache_create(device, &boot_sector, CACHE_SECTORS, sidecar_path(cursor->image_path, JOURNAL_SUFFIX));
+  replay_move_log(cursor);
+  load_index(cursor);
 
 	// Run the actual shell
 	run_shell(cursor);
 	
 	// Clean up
-	fclose(fat_file);
+	close_image(cursor);
 
   //free_cursor(cursor);
 	return 0;
@@ -0,0 +1,207 @@
+#include "device.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Copy-on-write overlay device (fat -o <delta> <image>, commit). See
+// device.h for the delta file's layout. Sectors only partly covered by a
+// write are first copied up from the base, so the delta always holds
+// whole sectors.
+
+#define COMMIT_BATCH (1024 * 1024)
+
+typedef struct {
+  Device base;
+  char *base_path;
+  int base_fd;
+  int delta_fd;
+  OverlayHeader header;
+
+  uint64_t sectors;
+  uint64_t *bitmap;         // sectors held by the delta
+  uint32_t bitmap_bytes;
+  bool bitmap_dirty;
+} Overlay;
+
+static bool has_sector(Overlay *ov, uint64_t s) {
+  return s < ov->sectors && ov->bitmap[s >> 6] >> (s & 63) & 1;
+}
+
+static void set_sector(Overlay *ov, uint64_t s) {
+  ov->bitmap[s >> 6] |= 1ULL << (s & 63);
+  ov->bitmap_dirty = true;
+}
+
+static uint64_t delta_offset(Overlay *ov, uint64_t offset) {
+  return ov->header.data_offset + offset;
+}
+
+static bool overlay_read(Device *dev, uint64_t offset, uint32_t length, void *buf) {
+  Overlay *ov = (Overlay *)dev;
+  uint32_t size = ov->header.sector_size;
+  uint64_t end = offset + length, pos = offset;
+
+  // Each run of sectors on the same side is a single read
+  while (pos < end) {
+    bool in_delta = has_sector(ov, pos / size);
+    uint64_t stop = (pos / size + 1) * size;
+    while (stop < end && has_sector(ov, stop / size) == in_delta) stop += size;
+    if (stop > end) stop = end;
+    bool ok = in_delta ? fd_read(ov->delta_fd, delta_offset(ov, pos), stop - pos, (char *)buf + (pos - offset))
+        : fd_read(ov->base_fd, pos, stop - pos, (char *)buf + (pos - offset));
+    if (!ok) return false;
+    pos = stop;
+  }
+  return true;
+}
+
+static bool copy_up(Overlay *ov, uint64_t s) {
+  uint32_t size = ov->header.sector_size;
+  char *buf = malloc(size);
+  bool ok = fd_read(ov->base_fd, s * size, size, buf) &&
+      fd_write(ov->delta_fd, delta_offset(ov, s * size), size, buf);
+  if (ok) set_sector(ov, s);
+  free(buf);
+  return ok;
+}
+
+static bool overlay_write(Device *dev, uint64_t offset, uint32_t length, const void *buf) {
+  Overlay *ov = (Overlay *)dev;
+  uint32_t size = ov->header.sector_size;
+  if (!length) return true;
+  uint64_t first = offset / size, last = (offset + length - 1) / size, s;
+  if (last >= ov->sectors) return false;
+
+  if (offset % size && !has_sector(ov, first) && !copy_up(ov, first)) return false;
+  if ((offset + length) % size && !has_sector(ov, last) && !copy_up(ov, last)) return false;
+  if (!fd_write(ov->delta_fd, delta_offset(ov, offset), length, buf)) return false;
+  for (s = first; s <= last; s++) set_sector(ov, s);
+  return true;
+}
+
+static bool overlay_writev(Device *dev, uint64_t offset, const struct iovec *iov, int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (!overlay_write(dev, offset, iov[i].iov_len, iov[i].iov_base)) return false;
+    offset += iov[i].iov_len;
+  }
+  return true;
+}
+
+static bool write_bitmap(Overlay *ov) {
+  return fd_write(ov->delta_fd, sizeof(OverlayHeader), ov->bitmap_bytes, ov->bitmap);
+}
+
+// Sector data is made durable before the bitmap that points at it
+static bool overlay_sync(Device *dev) {
+  Overlay *ov = (Overlay *)dev;
+  if (fsync(ov->delta_fd) != 0) return false;
+  if (!ov->bitmap_dirty) return true;
+  if (!write_bitmap(ov) || fsync(ov->delta_fd) != 0) return false;
+  ov->bitmap_dirty = false;
+  return true;
+}
+
+static void overlay_close(Device *dev) {
+  Overlay *ov = (Overlay *)dev;
+  close(ov->base_fd);
+  close(ov->delta_fd);
+  free(ov->bitmap);
+  free(ov->base_path);
+  free(ov);
+}
+
+// Writes a fresh header and empty bitmap, then sizes the file sparsely
+static bool create_delta(Overlay *ov) {
+  return fd_write(ov->delta_fd, 0, sizeof(OverlayHeader), &ov->header) && write_bitmap(ov) &&
+      ftruncate(ov->delta_fd, ov->header.data_offset + ov->header.base_size) == 0 &&
+      fsync(ov->delta_fd) == 0;
+}
+
+Device *overlay_open(const char *base_path, const char *delta_path) {
+  struct stat st;
+  int base_fd = open(base_path, O_RDONLY);
+  if (base_fd < 0 || fstat(base_fd, &st) != 0) {
+    if (base_fd >= 0) close(base_fd);
+    return NULL;
+  }
+  int delta_fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+  if (delta_fd < 0) {
+    close(base_fd);
+    return NULL;
+  }
+
+  Overlay *ov = calloc(1, sizeof(Overlay));
+  ov->base_path = strdup(base_path);
+  ov->base_fd = base_fd;
+  ov->delta_fd = delta_fd;
+  ov->sectors = (st.st_size + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+  ov->bitmap_bytes = (ov->sectors + 63) / 64 * sizeof(uint64_t);
+  ov->bitmap = calloc(1, ov->bitmap_bytes);
+
+  OverlayHeader header;
+  bool ok;
+  if (fd_read(delta_fd, 0, sizeof(header), &header) && header.magic == OVERLAY_MAGIC) {
+    // Reopening a view: it must have been made over this base
+    ov->header = header;
+    ok = header.sector_size == BYTES_PER_SECTOR && header.base_size == (uint64_t)st.st_size &&
+        fd_read(delta_fd, sizeof(OverlayHeader), ov->bitmap_bytes, ov->bitmap);
+  } else {
+    uint64_t data = sizeof(OverlayHeader) + ov->bitmap_bytes;
+    ov->header.magic = OVERLAY_MAGIC;
+    ov->header.sector_size = BYTES_PER_SECTOR;
+    ov->header.base_size = st.st_size;
+    ov->header.data_offset = (data + 4095) / 4096 * 4096;
+    ok = create_delta(ov);
+  }
+
+  ov->base.read = overlay_read;
+  ov->base.write = overlay_write;
+  ov->base.writev = overlay_writev;
+  ov->base.sync = overlay_sync;
+  ov->base.close = overlay_close;
+  ov->base.writable = true;
+  if (!ok) {
+    overlay_close(&ov->base);
+    return NULL;
+  }
+  return &ov->base;
+}
+
+bool is_overlay(Device *dev) {
+  return dev->read == overlay_read;
+}
+
+// The base is synced before the delta is emptied, so an interrupted commit
+// can simply be run again
+bool overlay_commit(Device *dev) {
+  Overlay *ov = (Overlay *)dev;
+  uint32_t size = ov->header.sector_size;
+  if (!overlay_sync(dev)) return false;
+  int fd = open(ov->base_path, O_WRONLY);
+  if (fd < 0) return false;
+
+  char *buf = malloc(COMMIT_BATCH);
+  uint64_t s = 0;
+  bool ok = true;
+  while (s < ov->sectors && ok) {
+    if (!has_sector(ov, s)) {
+      s++;
+      continue;
+    }
+    uint64_t run = 1;
+    while (s + run < ov->sectors && has_sector(ov, s + run) && (run + 1) * size <= COMMIT_BATCH) run++;
+    ok = fd_read(ov->delta_fd, delta_offset(ov, s * size), run * size, buf) &&
+        fd_write(fd, s * size, run * size, buf);
+    s += run;
+  }
+  free(buf);
+  ok = ok && fsync(fd) == 0;
+  close(fd);
+  if (!ok) return false;
+
+  // Clear the bitmap first; dropping the data region and growing it back
+  // then releases its blocks
+  memset(ov->bitmap, 0, ov->bitmap_bytes);
+  ov->bitmap_dirty = !(write_bitmap(ov) && fsync(ov->delta_fd) == 0);
+  return !ov->bitmap_dirty && ftruncate(ov->delta_fd, ov->header.data_offset) == 0 && create_delta(ov);
+}
@@ -0,0 +1,85 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+int pool_default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+static void *worker(void *arg) {
+  Pool *pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->head && !pool->stopping) pthread_cond_wait(&pool->work, &pool->lock);
+    if (!pool->head) break;
+
+    Task *task = pool->head;
+    pool->head = task->next;
+    if (!pool->head) pool->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    task->run(task->arg);
+    free(task);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+Pool *pool_create(int threads) {
+  Pool *pool = calloc(1, sizeof(Pool));
+  if (threads < 1) threads = 1;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->threads = malloc(sizeof(pthread_t) * threads);
+  for (pool->thread_count = 0; pool->thread_count < threads; pool->thread_count++) {
+    if (pthread_create(&pool->threads[pool->thread_count], NULL, worker, pool) != 0) break;
+  }
+  return pool;
+}
+
+void pool_submit(Pool *pool, void (*run)(void *arg), void *arg) {
+  // Without any workers, run inline
+  if (pool->thread_count == 0) {
+    run(arg);
+    return;
+  }
+
+  Task *task = malloc(sizeof(Task));
+  task->run = run;
+  task->arg = arg;
+  task->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail) pool->tail->next = task;
+  else pool->head = task;
+  pool->tail = task;
+  pool->pending++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(Pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(Pool *pool) {
+  int i;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->thread_count; i++) pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->threads);
+  free(pool);
+}
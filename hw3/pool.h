@@ -0,0 +1,37 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Fixed-size worker pool. Tasks may submit further tasks; pool_wait
+// returns once every task, including those, has finished.
+
+typedef struct task_t {
+  void (*run)(void *arg);
+  void *arg;
+  struct task_t *next;
+} Task;
+
+typedef struct {
+  pthread_t *threads;
+  int thread_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;    // signalled when a task is queued or on shutdown
+  pthread_cond_t idle;    // signalled when pending drops to zero
+  Task *head;
+  Task *tail;
+  int pending;            // queued plus running
+  bool stopping;
+} Pool;
+
+// Number of online CPUs, at least 1
+int pool_default_threads(void);
+
+Pool *pool_create(int threads);
+void pool_submit(Pool *pool, void (*run)(void *arg), void *arg);
+void pool_wait(Pool *pool);
+void pool_destroy(Pool *pool);
+
+#endif
@@ -10,6 +10,7 @@ int init_input(Input *input, char *str) {
   int length = strlen(str);
   input->string = (char *)malloc((length + 1) * sizeof(char));
   strcpy(input->string, str);
+  input->raw = strdup(str);
 }
 
 int destruct_input(Input *input) {
@@ -23,6 +24,31 @@ int destruct_input(Input *input) {
 
   // Free underlying string
   free(input->string);
+  free(input->raw);
+}
+
+// Splits the raw input on whitespace only, so host paths keep their '/'.
+// The returned words point into input->raw and skip the command itself.
+Word *host_args(Input *input) {
+  Word *head = NULL, *tail = NULL;
+  char *tok = strtok(input->raw, " \t\n");
+  if (!tok) return NULL;
+  while ((tok = strtok(NULL, " \t\n")) != NULL) {
+    Word *word = (Word *)malloc(sizeof(Word));
+    init_word(word, tok);
+    if (tail) tail->next = word;
+    else head = word;
+    tail = word;
+  }
+  return head;
+}
+
+void free_words(Word *word) {
+  while (word) {
+    Word *next = word->next;
+    free(word);
+    word = next;
+  }
 }
 
 
@@ -80,26 +106,75 @@ int get_input(char *str) {
   if (strcmp(str, "cd") == 0) return CD;
   if (strcmp(str, "cpout") == 0) return CPOUT;
   if (strcmp(str, "cpin") == 0) return CPIN;
+  if (strcmp(str, "hash") == 0) return HASH;
+  if (strcmp(str, "grep") == 0) return GREP;
+  if (strcmp(str, "scan-deleted") == 0) return SCAN_DELETED;
+  if (strcmp(str, "undelete") == 0) return UNDELETE;
+  if (strcmp(str, "defrag") == 0) return DEFRAG;
+  if (strcmp(str, "layout") == 0) return LAYOUT;
+  if (strcmp(str, "sync") == 0) return SYNC;
+  if (strcmp(str, "commit") == 0) return COMMIT;
+  if (strcmp(str, "index") == 0) return INDEX;
   return INVALID;
 }
 
 // Executes the input
 void execute_input(Cursor *cursor, Input *input) {
-	EntryNode *parent_node;
+	EntryNode parent_node;
   Word *word = input->words;
+  Word *args;
+  if (!word) return;
 
   switch (get_input(word->token)) {
     case LS:
-      parent_node->children = fs_ls(cursor, word->next);
-	  	display_children(parent_node);
+      parent_node.children = fs_ls(cursor, word->next);
+	  	display_children(&parent_node);
       break;
     case CD:
       fs_cd(cursor, word->next);
       break;
     case CPIN:
-      fs_cpin(cursor, word->next);
+      args = host_args(input);
+      fs_cpin(cursor, args);
+      free_words(args);
+      break;
+    case HASH:
+      args = host_args(input);
+      fs_hash(cursor, args);
+      free_words(args);
+      break;
+    case GREP:
+      args = host_args(input);
+      fs_grep(cursor, args);
+      free_words(args);
+      break;
+    case SCAN_DELETED:
+      fs_scan_deleted(cursor, word->next);
+      break;
+    case UNDELETE:
+      args = host_args(input);
+      fs_undelete(cursor, args);
+      free_words(args);
+      break;
+    case DEFRAG:
+      fs_defrag(cursor, word->next);
+      break;
+    case LAYOUT:
+      args = host_args(input);
+      fs_layout(cursor, args);
+      free_words(args);
+      break;
+    case SYNC:
+      fs_sync(cursor, word->next);
+      break;
+    case COMMIT:
+      fs_commit(cursor, word->next);
+      break;
+    case INDEX:
+      fs_index(cursor, word->next);
       break;
     case EXIT:
+      close_image(cursor);
       exit(0);
     default:
       disp_error(CODE_5, NULL, 0);
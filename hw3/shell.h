@@ -10,6 +10,15 @@ enum commands_t {
   CD,
   CPIN,
   CPOUT,
+  HASH,
+  GREP,
+  SCAN_DELETED,
+  UNDELETE,
+  DEFRAG,
+  LAYOUT,
+  SYNC,
+  COMMIT,
+  INDEX,
   EXIT,
   INVALID
 };
@@ -0,0 +1,277 @@
+#include "fat.h"
+#include "pool.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Deleted-file recovery (scan-deleted, undelete). Deleting a file on FAT
+// overwrites the first byte of its name with UNUSED_FLAG and frees its
+// chain, but leaves starting_cluster and size in the entry. If the
+// clusters the file would have occupied contiguously are still free, its
+// data is very likely intact. Directories are scanned in parallel against
+// a bitmap of free clusters built once from the in-memory FAT.
+
+typedef enum {
+  RECOVERABLE,    // every cluster the file needs is still free
+  PARTIAL,        // some of them have been reused
+  LOST,           // the first cluster has been reused
+} Recovery;
+
+static const char *recovery_names[] = { "RECOVERABLE", "PARTIAL", "LOST" };
+
+typedef struct {
+  char *path;
+  Fat16Entry entry;
+  Recovery status;
+  uint32_t free_clusters;
+  uint32_t clusters;
+} Deleted;
+
+typedef struct {
+  Cursor *cursor;
+  Pool *pool;
+  uint64_t *free_map;
+  uint32_t last_cluster;
+
+  pthread_mutex_t lock;
+  Deleted *found;
+  int count;
+  int capacity;
+} Scan;
+
+typedef struct {
+  Scan *scan;
+  uint16_t cluster;
+  char *prefix;
+  int depth;
+} DirTask;
+
+static bool cluster_free(Scan *scan, uint32_t c) {
+  if (c < 2 || c >= scan->last_cluster) return false;
+  return scan->free_map[c >> 6] >> (c & 63) & 1;
+}
+
+static void build_free_map(Scan *scan) {
+  uint16_t *fat = load_fat(scan->cursor);
+  uint32_t c;
+  scan->last_cluster = cluster_count(scan->cursor->bpb) + 2;
+  scan->free_map = calloc(scan->last_cluster / 64 + 1, sizeof(uint64_t));
+  for (c = 2; c < scan->last_cluster; c++) {
+    if (fat[c] == 0) scan->free_map[c >> 6] |= 1ULL << (c & 63);
+  }
+}
+
+static void assess(Scan *scan, Deleted *d) {
+  uint32_t csize = cluster_size(scan->cursor->bpb);
+  uint32_t i;
+  d->clusters = (d->entry.size + csize - 1) / csize;
+  d->free_clusters = 0;
+  for (i = 0; i < d->clusters; i++) {
+    if (cluster_free(scan, d->entry.starting_cluster + i)) d->free_clusters++;
+  }
+  if (d->free_clusters == d->clusters) d->status = RECOVERABLE;
+  else if (cluster_free(scan, d->entry.starting_cluster)) d->status = PARTIAL;
+  else d->status = LOST;
+}
+
+static void record(Scan *scan, Deleted *d) {
+  pthread_mutex_lock(&scan->lock);
+  if (scan->count == scan->capacity) {
+    scan->capacity = scan->capacity ? scan->capacity * 2 : 64;
+    scan->found = realloc(scan->found, sizeof(Deleted) * scan->capacity);
+  }
+  scan->found[scan->count++] = *d;
+  pthread_mutex_unlock(&scan->lock);
+}
+
+static void submit_dir(Scan *scan, uint16_t cluster, char *prefix, int depth);
+
+static void scan_dir(void *arg) {
+  DirTask *task = arg;
+  Scan *scan = task->scan;
+  uint32_t length, i;
+  char *data = read_dir_data(scan->cursor, task->cluster, &length);
+
+  for (i = 0; i + 32 <= length; i += 32) {
+    Fat16Entry entry;
+    memcpy(&entry, data + i, sizeof(entry));
+    if (entry.name[0] == 0) break;
+    if ((entry.attributes & DIR_ATTR_LFN) == DIR_ATTR_LFN || entry.attributes & DIR_ATTR_VOLUMEID)
+      continue;
+    if (entry.name[0] == '.') continue;
+
+    bool deleted = entry.name[0] == UNUSED_FLAG;
+    char name[13];
+    if (deleted) entry.name[0] = '?';
+    entry_file_name(&entry, name);
+    char *path = join_path(task->prefix, name);
+
+    if (entry.attributes & DIR_ATTR_DIRECTORY) {
+      // A deleted directory can still be read while its first cluster is free
+      if (task->depth < MAX_WALK_DEPTH && entry.starting_cluster >= 2 &&
+          (!deleted || cluster_free(scan, entry.starting_cluster))) {
+        submit_dir(scan, entry.starting_cluster, path, task->depth + 1);
+        continue;
+      }
+    } else if (deleted) {
+      Deleted d = { path, entry, RECOVERABLE, 0, 0 };
+      assess(scan, &d);
+      record(scan, &d);
+      continue;
+    }
+    free(path);
+  }
+
+  free(data);
+  free(task->prefix);
+  free(task);
+}
+
+static void submit_dir(Scan *scan, uint16_t cluster, char *prefix, int depth) {
+  DirTask *task = malloc(sizeof(DirTask));
+  task->scan = scan;
+  task->cluster = cluster;
+  task->prefix = prefix;
+  task->depth = depth;
+  pool_submit(scan->pool, scan_dir, task);
+}
+
+static int compare_deleted(const void *a, const void *b) {
+  return strcmp(((const Deleted *)a)->path, ((const Deleted *)b)->path);
+}
+
+// Scans the current directory's subtree; results are sorted by path
+static void run_scan(Cursor *cursor, Scan *scan) {
+  memset(scan, 0, sizeof(Scan));
+  scan->cursor = cursor;
+  pthread_mutex_init(&scan->lock, NULL);
+  build_free_map(scan);
+
+  scan->pool = pool_create(pool_default_threads());
+  submit_dir(scan, current_cluster(cursor), strdup(""), 0);
+  pool_wait(scan->pool);
+  pool_destroy(scan->pool);
+
+  qsort(scan->found, scan->count, sizeof(Deleted), compare_deleted);
+}
+
+static void free_scan(Scan *scan) {
+  int i;
+  for (i = 0; i < scan->count; i++) free(scan->found[i].path);
+  free(scan->found);
+  free(scan->free_map);
+  pthread_mutex_destroy(&scan->lock);
+}
+
+// scan-deleted: lists every deleted file under the current directory with
+// an estimate of whether its data survives. The first character of a
+// deleted name is lost and shown as '?'.
+void fs_scan_deleted(Cursor *cursor, Word *args) {
+  Scan scan;
+  int i;
+  (void)args;
+  run_scan(cursor, &scan);
+  for (i = 0; i < scan.count; i++) {
+    Deleted *d = &scan.found[i];
+    printf("%-11s %10u %5u %3u/%-3u %s\n", recovery_names[d->status], d->entry.size,
+        d->entry.starting_cluster, d->free_clusters, d->clusters, d->path);
+  }
+  free_scan(&scan);
+}
+
+char *host_path(const char *dir, const char *path) {
+  char *out = malloc(strlen(dir) + strlen(path) + 2);
+  char *c = out + sprintf(out, "%s", dir), *start;
+  while (*path) {
+    while (*path == '/') path++;
+    if (!*path) break;
+    *c++ = '/';
+    start = c;
+    for (; *path && *path != '/'; path++) {
+      unsigned char b = *path;
+      *c++ = b < 0x20 || b == 0x7F || b == '\\' || b == '?' ? '_' : b;
+    }
+    if ((c - start == 1 && start[0] == '.') || (c - start == 2 && start[0] == '.' && start[1] == '.')) {
+      c = start;
+      *c++ = '_';
+    }
+  }
+  *c = '\0';
+  return out;
+}
+
+void make_parents(char *path) {
+  char *slash;
+  for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+  }
+}
+
+// Creates *path without replacing anything already there. Recovered names
+// lose their first byte, so two files can map to the same path; later ones
+// get a .1, .2, ... suffix and *path is changed to the name used.
+static FILE *create_new(char **path) {
+  char *name = *path;
+  int n = 0;
+  for (;;) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+      *path = name;
+      return fdopen(fd, "wb");
+    }
+    if (errno != EEXIST) break;
+    if (name != *path) free(name);
+    name = malloc(strlen(*path) + 12);
+    sprintf(name, "%s.%d", *path, ++n);
+  }
+  if (name != *path) free(name);
+  return NULL;
+}
+
+static bool extract_run(Cursor *cursor, Deleted *d, char **host_path) {
+  BPB *bpb = cursor->bpb;
+  char *requested = *host_path;
+  FILE *out = create_new(host_path);
+  if (*host_path != requested) free(requested);
+  if (!out) return false;
+
+  // The data was contiguous when the file was written, so read it as one run
+  uint32_t length = d->entry.size;
+  char *buf = malloc(length ? length : 1);
+  bool ok = !length || read_data(cursor, cluster_address(bpb, d->entry.starting_cluster), length, buf);
+  ok = ok && fwrite(buf, 1, length, out) == length;
+  free(buf);
+  return fclose(out) == 0 && ok;
+}
+
+// undelete <host dir>: extracts every RECOVERABLE file found by
+// scan-deleted into host dir, under names made safe by host_path. Existing
+// files are never overwritten.
+void fs_undelete(Cursor *cursor, Word *args) {
+  if (!args) {
+    disp_error(CODE_5, NULL, 0);
+    return;
+  }
+
+  Scan scan;
+  int i, recovered = 0;
+  run_scan(cursor, &scan);
+  for (i = 0; i < scan.count; i++) {
+    Deleted *d = &scan.found[i];
+    if (d->status != RECOVERABLE) continue;
+
+    char *target = host_path(args->token, d->path);
+    make_parents(target);
+    if (extract_run(cursor, d, &target)) {
+      printf("%s\n", target);
+      recovered++;
+    } else {
+      disp_error(CODE_9, target, 0);
+    }
+    free(target);
+  }
+  printf("%d of %d deleted files recovered\n", recovered, scan.count);
+  free_scan(&scan);
+}